@@ -28,5 +28,12 @@ export const onRequest = defineMiddleware(async (context, next) => {
     locals.user = null;
   }
 
-  return next();
+  // The game page is cross-origin isolated, so that the threaded Web3D build
+  // can use SharedArrayBuffer.
+  const response = await next();
+  if (context.url.pathname === "/game") {
+    response.headers.set("Cross-Origin-Opener-Policy", "same-origin");
+    response.headers.set("Cross-Origin-Embedder-Policy", "require-corp");
+  }
+  return response;
 });
@@ -0,0 +1,246 @@
+// Engine worker. The page hands over its canvas (as an OffscreenCanvas) and the
+// user, and everything else happens on this thread: loading the engine,
+// talking to the game server and drawing frames. Key events arrive through a
+// shared input ring (or as messages, if the page can't share memory).
+import { InputRing } from "./input.ts";
+import { recordTrace } from "./trace.ts";
+import { MessageWriter, PROTOCOL_VERSION } from "./protocol.ts";
+
+import web3dSingleUrl from "./web3d.wasm?url";
+import web3dThreadedUrl from "./web3d-mt.wasm?url";
+
+// Size of the shared memory used by the threaded build, in 64 KiB pages (this
+// should match --initial-memory/--max-memory in the makefile).
+const MEMORY_PAGES = 512;
+
+// Maximum number of render workers (this should match MAX_THREADS in main.c).
+const MAX_RENDER_THREADS = 8;
+
+// Resolution to render at with each build of the engine, and the time budget
+// for drawing a frame in milliseconds. The engine lowers the resolution (down
+// to half of this) whenever it can't draw frames within the budget.
+const RESOLUTION_SINGLE = [360, 200];
+const RESOLUTION_THREADED = [640, 360];
+const FRAME_BUDGET = 8;
+
+// Whether to shade only every other column each frame, and reproject the rest
+// from the previous frame.
+const INTERLACED = true;
+
+// Messages from the page.
+export type EngineMessage =
+    | {
+        type: "start";
+        canvas: OffscreenCanvas;
+        user: { id: number; username: string } | null;
+        hostname: string;
+        input: SharedArrayBuffer | null; // Input ring, if memory can be shared.
+        record: boolean;                 // Whether to record a trace.
+    }
+    | { type: "key"; keyCode: number; down: boolean }
+    | { type: "trace" };
+
+// Exports of the engine instance running on this thread.
+let web3d: any = null;
+
+// Trace of the calls into the engine so far, and a function for recording
+// messages, when recording.
+let trace: (() => Uint8Array) | null = null;
+let recordMessage: ((data: Uint8Array) => void) | null = null;
+
+// Send a message in WebAssembly memory to the server (see src/protocol.c).
+// Returns whether the message was sent.
+function sendMessage(socket: WebSocket, addr: number, size: number) {
+    if (!socket || socket.readyState !== WebSocket.OPEN)
+        return false;
+    socket.send(new Uint8Array(web3d.memory.buffer, addr, size).slice());
+    return true;
+}
+
+// Convert a string to UTF-8 and write the bytes to a buffer in WebAssembly
+// memory. The string is truncated if it's too long to fit the buffer, but is
+// always null-terminated. Returns the length of the string (sans null
+// terminator).
+function getString(str: string, addr: number, length: number) {
+    const textEncoder = new TextEncoder();
+    const source = textEncoder.encode(str);
+    length = Math.min(source.length, length - 1);
+    const target = new Uint8Array(web3d.memory.buffer, addr, length + 1);
+    target.set(source.subarray(0, length));
+    target[length] = 0;
+    return length;
+}
+
+// Get the current time in milliseconds, for measuring how long frames take.
+function getTime() {
+    return performance.now();
+}
+
+// Functions imported by the engine.
+const imports = { "islands/Web3D": { getString, sendMessage, getTime } };
+
+// Try to start the threaded build of the engine. This needs SharedArrayBuffer,
+// which browsers only allow on cross-origin isolated pages. Returns the exports
+// of this thread's instance (and the workers rendering for it), or null if the
+// single-threaded build should be used instead.
+async function loadThreaded() {
+    const threads = Math.min(navigator.hardwareConcurrency - 1, MAX_RENDER_THREADS);
+    if (!globalThis.crossOriginIsolated || threads < 1)
+        return null;
+    try {
+        const module = await WebAssembly.compileStreaming(fetch(web3dThreadedUrl));
+        const memory = new WebAssembly.Memory({
+            initial: MEMORY_PAGES,
+            maximum: MEMORY_PAGES,
+            shared: true,
+        });
+        const instance = await WebAssembly.instantiate(module, { env: { memory }, ...imports });
+        const workers = [];
+        for (let index = 0; index < threads; index++) {
+            const worker = new Worker(new URL("./worker.ts", import.meta.url), { type: "module" });
+            worker.postMessage({ module, memory, index });
+            workers.push(worker);
+        }
+        return { exports: { ...instance.exports, memory }, workers };
+    } catch (error) {
+        console.log("Threaded renderer unavailable:", error);
+        return null;
+    }
+}
+
+// Start the single-threaded build of the engine.
+async function loadSingle() {
+    const { instance } = await WebAssembly.instantiateStreaming(fetch(web3dSingleUrl), imports);
+    return { exports: instance.exports, workers: [] };
+}
+
+// Add a message from the server to the engine's message queue (see
+// `recv_messages()` in main.c), to be handled by the next call to `draw()`. If
+// the queue is full, the messages in it are handled right away to make room.
+// The queue starts with its capacity and length, and each message with its size.
+const QUEUE_HEADER_SIZE = 8;
+const MESSAGE_HEADER_SIZE = 8;
+let queueBytes: Uint8Array | null = null;
+let queueView: DataView | null = null;
+function queueMessage(message: ArrayBuffer) {
+    const memory = web3d.memory.buffer;
+    if (!queueBytes || !queueView || queueBytes.buffer !== memory) {
+        queueBytes = new Uint8Array(memory);
+        queueView = new DataView(memory, web3d.messageQueue());
+    }
+    const data = new Uint8Array(message);
+    const capacity = queueView.getUint32(0, true);
+    const size = MESSAGE_HEADER_SIZE + ((data.length + 7) & ~7);
+    if (size > capacity)
+        return console.log("Message too long", data.length);
+    if (queueView.getUint32(4, true) + size > capacity)
+        web3d.recvMessages();
+    const length = queueView.getUint32(4, true);
+    const offset = QUEUE_HEADER_SIZE + length;
+    queueView.setUint32(offset, data.length, true);
+    queueBytes.set(data, queueView.byteOffset + offset + MESSAGE_HEADER_SIZE);
+    queueView.setUint32(4, length + size, true);
+    recordMessage?.(data);
+}
+
+// Pass a key event to the engine.
+function handleKey(keyCode: number, down: boolean) {
+    if (down)
+        web3d.keydown(keyCode);
+    else
+        web3d.keyup(keyCode);
+}
+
+// Load the engine, connect to the server and start drawing frames.
+async function start({ canvas, user, hostname, input, record }: Extract<EngineMessage, { type: "start" }>) {
+    const threaded = await loadThreaded();
+    const { exports, workers } = threaded ?? await loadSingle();
+    web3d = exports;
+    if (record) {
+        const recording = recordTrace(web3d);
+        web3d = recording.exports;
+        trace = recording.trace;
+        recordMessage = recording.message;
+    }
+    const inputRing = input && new InputRing(input);
+    const username = user && user.username;
+    const playerId = user && user.id;
+
+    // The canvas is resized to match the frame whenever the engine changes its
+    // resolution.
+    const context = canvas.getContext("2d") as OffscreenCanvasRenderingContext2D;
+
+    // Frames are presented straight from WebAssembly memory, through an
+    // ImageData that wraps the frame buffer and is only recreated when the
+    // frame moves or changes size. Shared memory (in the threaded build) can't
+    // back an ImageData, so the regions that changed are copied out instead.
+    const shared = typeof SharedArrayBuffer !== "undefined" && web3d.memory.buffer instanceof SharedArrayBuffer;
+    let imageData: ImageData | null = null;
+    let imageAddr = 0;
+
+    // Connect to the game server.
+    let socket: WebSocket | null = null;
+    if (username && playerId) {
+        socket = new WebSocket("wss://" + hostname + ":3002/web3d");
+        socket.binaryType = "arraybuffer";
+        socket.onmessage = event => queueMessage(event.data);
+        socket.onopen = _event => {
+            if (username && playerId && socket)
+                socket.send(new MessageWriter().u8(PROTOCOL_VERSION).varint(playerId).string(username).finish());
+        };
+    }
+
+    // Make a callback function for updating the frame
+    const render = (timestamp: DOMHighResTimeStamp) => {
+        inputRing?.drain(handleKey);
+        const frameAddr = web3d.draw(socket, timestamp, Date.now(), username != null);
+        const width = web3d.frameWidth();
+        const height = web3d.frameHeight();
+        const memory = web3d.memory.buffer;
+        let full = false;
+        if (!imageData || width !== imageData.width || height !== imageData.height || frameAddr !== imageAddr ||
+            (!shared && imageData.data.buffer !== memory)) {
+            if (width !== canvas.width || height !== canvas.height) {
+                canvas.width = width;
+                canvas.height = height;
+            }
+            imageData = shared ? context.createImageData(width, height) :
+                new ImageData(new Uint8ClampedArray(memory, frameAddr, width * height * 4), width, height);
+            imageAddr = frameAddr;
+            full = true;
+        }
+
+        // Present only the regions of the frame that changed (which is all of
+        // it, unless the engine reused the 3D view of the previous frame).
+        const dirtyAddr = web3d.dirtyRects();
+        const rects = full ? new Int32Array([0, 0, width, height]) :
+            new Int32Array(memory, dirtyAddr + 4, new Int32Array(memory, dirtyAddr, 1)[0] * 4);
+        for (let i = 0; i < rects.length; i += 4) {
+            const [x, y, w, h] = rects.subarray(i, i + 4);
+            if (shared) {
+                for (let row = y; row < y + h; row++) {
+                    const offset = (row * width + x) * 4;
+                    imageData.data.set(new Uint8Array(memory, frameAddr + offset, w * 4), offset);
+                }
+            }
+            context.putImageData(imageData, 0, 0, x, y, w, h);
+        }
+        requestAnimationFrame(render);
+    };
+
+    // Render the first frame
+    web3d.init();
+    web3d.setResolution(...(workers.length ? RESOLUTION_THREADED : RESOLUTION_SINGLE));
+    web3d.setFrameBudget(FRAME_BUDGET);
+    web3d.setInterlaced(INTERLACED);
+    render(performance.now());
+}
+
+onmessage = (event: MessageEvent<EngineMessage>) => {
+    const message = event.data;
+    switch (message.type) {
+        case "start": return start(message);
+        case "key": return web3d && handleKey(message.keyCode, message.down);
+        case "trace": return postMessage({ type: "trace", trace: trace ? trace() : null });
+    }
+};
@@ -0,0 +1,43 @@
+// Ring buffer of key events in shared memory, for passing input from the page
+// to the engine worker without going through `postMessage()`. There's a single
+// writer (the page) that only moves the head, and a single reader (the engine
+// worker) that only moves the tail, so neither side ever waits for the other.
+// Each event is a keycode, shifted left by one, with the low bit set for a key
+// press.
+const INPUT_CAPACITY = 64; // Must be a power of two.
+
+// Indices of the head and tail in the shared array; events follow them.
+const HEAD = 0;
+const TAIL = 1;
+const EVENTS = 2;
+
+export class InputRing {
+    readonly buffer: SharedArrayBuffer;
+    private state: Int32Array;
+
+    constructor(buffer = new SharedArrayBuffer((EVENTS + INPUT_CAPACITY) * 4)) {
+        this.buffer = buffer;
+        this.state = new Int32Array(buffer);
+    }
+
+    // Add a key event. The event is dropped if the ring is full, which only
+    // happens when the engine has stopped reading it.
+    push(keyCode: number, down: boolean) {
+        const head = Atomics.load(this.state, HEAD);
+        if (((head - Atomics.load(this.state, TAIL)) | 0) >= INPUT_CAPACITY)
+            return;
+        this.state[EVENTS + (head & (INPUT_CAPACITY - 1))] = (keyCode << 1) | (down ? 1 : 0);
+        Atomics.store(this.state, HEAD, (head + 1) | 0);
+    }
+
+    // Pass every event added since the last call to a handler, oldest first.
+    drain(handle: (keyCode: number, down: boolean) => void) {
+        const head = Atomics.load(this.state, HEAD);
+        let tail = Atomics.load(this.state, TAIL);
+        for (; tail !== head; tail = (tail + 1) | 0) {
+            const event = this.state[EVENTS + (tail & (INPUT_CAPACITY - 1))];
+            handle(event >> 1, (event & 1) === 1);
+        }
+        Atomics.store(this.state, TAIL, tail);
+    }
+}
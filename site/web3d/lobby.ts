@@ -0,0 +1,491 @@
+// Lobby worker. The server (server.ts) owns the sockets, and runs each lobby
+// on one of a pool of these workers: it forwards what clients send, and the
+// worker runs the match and tells the server what to send to each client.
+// Every lobby is an independent match, with its own players, gems and timers.
+import { recordMatch } from "../utils/recordMatch.ts";
+import { MessageReader, MessageType, MessageWriter, MoveField, type MoveState } from "./protocol.ts";
+import { MAP_H, MAP_W, dequantizePosition } from "./protocol.ts";
+
+// Lobby configuration.
+const MATCH_COUNTDOWN = 5; // Length of countdown for a match, in seconds.
+const MAX_GEMS = 50n; // Gems to collect per match.
+const COLLECT_DELAY = 1000; // Milliseconds after the start of a match before gems count (should match main.c).
+const ALL_GEMS = (1n << MAX_GEMS) - 1n; // Bit mask for all gems.
+const MAX_PLAYER_NAME = 32; // Maximum player name length.
+const TICK_RATE = 10; // Snapshots of player movement sent per second (clients interpolate between them).
+const FOG_HIDDEN = 0.9; // Amount of fog that hides a player (see `apply_fog()` in main.c).
+const INTEREST_RADIUS = 9 / (1 - FOG_HIDDEN) - 9; // Distance (in tiles) where the fog reaches FOG_HIDDEN.
+const DISTANT_RATE = 5; // Moves of players further away sent per second (see below).
+const DISTANT_TICKS = Math.max(Math.round(TICK_RATE / DISTANT_RATE), 1);
+
+// Clients draw other players 150 ms in the past, and extrapolate for up to
+// 100 ms when moves are late (see PLAYER_INTERPOLATION_DELAY and
+// PLAYER_EXTRAPOLATION in main.c), so distant players only keep moving smoothly
+// if their moves are sent at least every 250 ms.
+
+// Messages from the server.
+export type LobbyMessage =
+    | { type: "join"; lobby: number; socket: number; id: number; name: string }
+    | { type: "message"; socket: number; data: Uint8Array }
+    | { type: "quit"; socket: number }
+    | { type: "blocked"; socket: number } // The client can't keep up.
+    | { type: "drain"; socket: number };  // The client caught up.
+
+// Messages to the server. Messages for clients are sent in one buffer (which is
+// transferred rather than copied), as a varint socket, varint size and the
+// message for each.
+export type ServerMessage =
+    | { type: "send"; data: ArrayBuffer }
+    | { type: "shed"; socket: number; bytes: number };
+
+// A client in a lobby. While a client can't keep up, the server holds on to
+// the messages sent to it, except for snapshots: only the fields of each
+// player's move that changed are kept, and sent as one snapshot with the
+// latest state once the client catches up. The bytes of the snapshots that
+// weren't sent (less the one sent in their place) are counted as shed.
+type Player = {
+    socket: number;                  // ID of the client's socket in the server.
+    id: number;                      // User ID.
+    name: string;
+    score: number;
+    move: MoveState | null;          // Latest position and heading.
+    changed: number;                 // Fields of the move changed since the last tick.
+    moving: boolean;                 // Whether the move changed in the last tick.
+    distantChanged: number;          // Fields changed since the last distant update.
+    cell: number;                    // Index of the grid cell the player is in (or -1).
+    near: Set<Player>;               // Players within the interest radius at the last tick.
+    blocked: boolean;                // Whether the client can't keep up.
+    withheld: Map<Player, number>;   // Fields of the moves not sent, per player.
+    withheldBytes: number;           // Size of the snapshots not sent.
+};
+
+// Messages for the server, which are posted together once the current event
+// (like a tick of every lobby on this worker) has been handled.
+let outgoing: MessageWriter | null = null;
+
+// Start a snapshot, which has the time it was taken (so that clients can tell
+// when each move happened, however late it arrives).
+const SNAPSHOT_HEADER_SIZE = 9;
+function snapshotWriter(time = Date.now()) {
+    return new MessageWriter().u8(MessageType.Snapshot).f64(time);
+}
+
+function post(player: Player, message: Uint8Array) {
+    if (!outgoing) {
+        outgoing = new MessageWriter();
+        queueMicrotask(() => {
+            const data = outgoing!.finish().buffer;
+            outgoing = null;
+            postMessage({ type: "send", data } satisfies ServerMessage, [data]);
+        });
+    }
+    outgoing.varint(player.socket).varint(message.length).append(message);
+}
+
+// Uniform grid of player positions, for finding the players near a point
+// without looking at every player in the lobby. Cells are half as wide as the
+// interest radius, so the players within that radius of a point are all in
+// the GRID_RINGS rings of cells around its cell. (The interest radius is wider
+// than the current map, so that's a single cell, and every player is near.)
+const GRID_CELL = INTEREST_RADIUS / 2;
+const GRID_RINGS = Math.ceil(INTEREST_RADIUS / GRID_CELL);
+const GRID_W = Math.ceil(MAP_W / GRID_CELL);
+const GRID_H = Math.ceil(MAP_H / GRID_CELL);
+class Grid {
+    cells = new Map<number, Set<Player>>();
+
+    // Get the cell of a position.
+    static cell(move: MoveState) {
+        const x = Math.min(Math.floor(dequantizePosition(move.x, MAP_W) / GRID_CELL), GRID_W - 1);
+        const y = Math.min(Math.floor(dequantizePosition(move.y, MAP_H) / GRID_CELL), GRID_H - 1);
+        return x + y * GRID_W;
+    }
+
+    // Move a player to the cell of their latest position.
+    update(player: Player) {
+        const cell = player.move ? Grid.cell(player.move) : -1;
+        if (cell === player.cell)
+            return;
+        this.remove(player);
+        let players = this.cells.get(cell);
+        if (!players)
+            this.cells.set(cell, players = new Set());
+        players.add(player);
+        player.cell = cell;
+    }
+
+    // Remove a player from the grid.
+    remove(player: Player) {
+        const players = this.cells.get(player.cell);
+        players?.delete(player);
+        if (players?.size === 0)
+            this.cells.delete(player.cell);
+        player.cell = -1;
+    }
+
+    // Get the players within the interest radius of a position.
+    *near(move: MoveState) {
+        const cell = Grid.cell(move);
+        const cx = cell % GRID_W;
+        const cy = Math.floor(cell / GRID_W);
+        for (let y = Math.max(cy - GRID_RINGS, 0); y <= Math.min(cy + GRID_RINGS, GRID_H - 1); y++) {
+            for (let x = Math.max(cx - GRID_RINGS, 0); x <= Math.min(cx + GRID_RINGS, GRID_W - 1); x++) {
+                for (const player of this.cells.get(x + y * GRID_W) ?? []) {
+                    const dx = dequantizePosition(player.move!.x - move.x, MAP_W);
+                    const dy = dequantizePosition(player.move!.y - move.y, MAP_H);
+                    if (dx * dx + dy * dy <= INTEREST_RADIUS * INTEREST_RADIUS)
+                        yield player;
+                }
+            }
+        }
+    }
+}
+
+// Count the number of ones in the binary representation of a BigInt.
+function countBitsSet(value: BigInt): number {
+    let count = 0;
+    while (value !== 0n) {
+        count += Number(value & 1n);
+        value >>= 1n;
+    }
+    return count;
+}
+
+class Lobby {
+    id: number;
+    clients = new Set<Player>(); // Currently connected clients.
+    players = new Set<Player>(); // Players in the current match.
+    startTime = Date.now(); // Time of the start of the game (and also the RNG seed).
+    nextMatchTimer = 0; // Timer ID for the start of the next match.
+    nextMatch = this.startTime; // Timestamp for the start of the next match.
+    gemMask = 0n; // Bit mask of gems that have not been collected.
+    ghostId = 0; // Client ID of the current ghost.
+    grid = new Grid(); // Positions of the players that have moved.
+    tickCount = 0; // Number of ticks so far.
+
+    constructor(id: number) {
+        this.id = id;
+    }
+
+    log(...args: any[]) {
+        console.log(`[lobby ${this.id}]`, ...args);
+    }
+
+    // Send a join message.
+    sendJoinMessage(recipient: Player, joined: Player) {
+        const name = joined.name.slice(0, MAX_PLAYER_NAME - 1);
+        post(recipient, new MessageWriter().u8(MessageType.Join).varint(joined.id).varint(joined.score)
+            .string(name).finish());
+    }
+
+    // Send a begin message.
+    sendBeginMessage(client: Player) {
+        post(client, new MessageWriter().u8(MessageType.Begin).varint(client.id).varint(this.ghostId)
+            .f64(this.startTime).varint(Number(this.gemMask)).finish());
+    }
+
+    // Send a snapshot with the full position and heading of every other player
+    // that has moved, which later snapshots (that only have the fields that
+    // changed) are deltas of.
+    sendFullSnapshot(recipient: Player) {
+        const writer = snapshotWriter();
+        for (const other of this.clients)
+            if (other !== recipient && other.move)
+                writer.varint(other.id).move(MoveField.All, other.move);
+        if (writer.length > SNAPSHOT_HEADER_SIZE)
+            post(recipient, writer.finish());
+    }
+
+    // Send every client a snapshot of the other players that moved since the
+    // last tick. Moves are only kept until then, so however often clients send
+    // them, each client gets one message per tick. Clients only get every move
+    // of the players within the interest radius (and the full state of players
+    // that just came within it); moves of the players further away are merged,
+    // and sent every DISTANT_TICKS ticks. Clients that can't keep up get the
+    // latest state once they catch up instead (see Player). Players that just
+    // stopped get a move with no fields, so that clients know when they did.
+    tick() {
+        const time = Date.now();
+        const distant = ++this.tickCount % DISTANT_TICKS === 0;
+        const moves = new Map<Player, { fields: number; move: Uint8Array }>();
+        for (const client of this.clients) {
+            if (client.move && (client.changed || client.moving)) {
+                const move = new MessageWriter().varint(client.id).move(client.changed, client.move).finish();
+                moves.set(client, { fields: client.changed, move });
+                client.distantChanged |= client.changed;
+                client.moving = client.changed !== 0;
+                client.changed = 0;
+                this.grid.update(client);
+            }
+        }
+        if (moves.size === 0 && !distant)
+            return;
+        for (const recipient of this.clients) {
+            const writer = snapshotWriter(time);
+            const entries = new Map<Player, number>();
+            const add = (other: Player, fields: number) => {
+                const move = moves.get(other);
+                if (move && move.fields === fields)
+                    writer.append(move.move);
+                else
+                    writer.varint(other.id).move(fields, other.move!);
+                entries.set(other, fields);
+            };
+
+            // Players within the interest radius.
+            const near = new Set<Player>();
+            for (const other of recipient.move ? this.grid.near(recipient.move) : []) {
+                if (other === recipient)
+                    continue;
+                near.add(other);
+                if (!recipient.near.has(other))
+                    add(other, MoveField.All);
+                else if (moves.has(other))
+                    add(other, moves.get(other)!.fields);
+            }
+            recipient.near = near;
+
+            // Everyone else.
+            if (distant)
+                for (const other of this.clients)
+                    if (other !== recipient && !near.has(other) && other.move && other.distantChanged)
+                        add(other, other.distantChanged);
+
+            if (writer.length === SNAPSHOT_HEADER_SIZE)
+                continue;
+            const snapshot = writer.finish();
+            if (!recipient.blocked) {
+                post(recipient, snapshot);
+                continue;
+            }
+            for (const [other, fields] of entries)
+                recipient.withheld.set(other, (recipient.withheld.get(other) ?? 0) | fields);
+            recipient.withheldBytes += snapshot.length;
+        }
+        if (distant)
+            for (const client of this.clients)
+                client.distantChanged = 0;
+    }
+
+    // Send a snapshot in place of the ones a client missed, once it catches up.
+    drain(client: Player) {
+        client.blocked = false;
+        if (client.withheld.size === 0)
+            return;
+        const writer = snapshotWriter();
+        for (const [other, fields] of client.withheld)
+            if (this.clients.has(other) && other.move)
+                writer.varint(other.id).move(fields, other.move);
+        const snapshot = writer.finish();
+        if (snapshot.length > SNAPSHOT_HEADER_SIZE)
+            post(client, snapshot);
+        const bytes = Math.max(client.withheldBytes - snapshot.length, 0);
+        postMessage({ type: "shed", socket: client.socket, bytes } satisfies ServerMessage);
+        client.withheld.clear();
+        client.withheldBytes = 0;
+    }
+
+    // Send a message to all connected clients.
+    broadcastMessage(message: Uint8Array) {
+        for (const client of this.clients)
+            post(client, message);
+    }
+
+    // Handle a player movement message from a client. The client only sends
+    // the fields that changed, which are applied to its state, and passed on
+    // to the other clients with the next snapshot.
+    handleMoveMessage(client: Player, reader: MessageReader) {
+        const move = client.move ?? { x: 0, y: 0, heading: 0 };
+        const fields = reader.move(move) & MoveField.All;
+        if (reader.error || !fields)
+            return;
+        client.move = move;
+        client.changed |= fields;
+    }
+
+    // Start a new match.
+    startMatch() {
+        this.nextMatchTimer = 0;
+        this.startTime = Date.now();
+        this.gemMask = ALL_GEMS;
+        for (const client of this.clients) {
+            client.score = 0;
+            this.sendBeginMessage(client);
+        }
+        this.log("A new match started!");
+    }
+
+    // End a match.
+    endMatch() {
+
+        // Record the results in the database.
+        const playerArray = Array.from(this.players);
+        const playerIds = playerArray.map(p => p.id);
+        const scores = playerArray.map(p => p.score);
+        recordMatch({game: "web3d", playerIds, scores})
+            .catch(error => console.error(error));
+
+        // Notify the clients that the game ended.
+        this.players = new Set(this.clients);
+        this.broadcastMessage(new MessageWriter().u8(MessageType.End).finish());
+        this.gemMask = 0n;
+        this.log("The match ended!");
+    }
+
+    // Begin the countdown for the next match.
+    beginCountdown() {
+        if (this.nextMatchTimer === 0) {
+            this.nextMatch = Date.now() + MATCH_COUNTDOWN * 1000;
+            this.broadcastMessage(new MessageWriter().u8(MessageType.Count).f64(this.nextMatch).finish());
+            this.nextMatchTimer = setTimeout(() => this.startMatch(), MATCH_COUNTDOWN * 1000);
+            this.log("Starting a new match in", MATCH_COUNTDOWN, "seconds");
+        }
+    }
+
+    // Send a collect message (with a negative gem index for a score update).
+    broadcastCollectMessage(client: Player, gemIndex: number) {
+        this.broadcastMessage(new MessageWriter().u8(MessageType.Collect).varint(client.id).zigzag(gemIndex)
+            .varint(client.score).finish());
+    }
+
+    // Handle a gem collect message from a client.
+    handleCollectMessage(client: Player, reader: MessageReader) {
+        const gemIndex = reader.zigzag();
+        if (reader.error || gemIndex < 0 || gemIndex >= Number(MAX_GEMS))
+            return;
+        const gemBit = 1n << BigInt(gemIndex);
+        if ((this.gemMask & gemBit) && Date.now() >= this.startTime + COLLECT_DELAY) {
+            client.score++;
+            this.gemMask &= ~gemBit; // Mark the gem as collected.
+            this.broadcastCollectMessage(client, gemIndex);
+        }
+
+        // Start a new match when all gems have been collected.
+        if (this.gemMask === 0n && this.clients.size > 1) {
+            this.log("All gems were collected!");
+            this.endMatch();
+            this.beginCountdown();
+        }
+    }
+
+    // Add a client that logged in.
+    join(client: Player) {
+        const secondPlayerJoined = this.clients.size === 1;
+        this.clients.add(client);
+        this.players.add(client);
+        this.log(`New login ${client.name} (UID ${client.id})`);
+
+        // Send join and begin messages to the new client, and where the other
+        // players are.
+        for (const other of this.players)
+            this.sendJoinMessage(client, other);
+        this.sendBeginMessage(client);
+        this.sendFullSnapshot(client);
+
+        // Send join messages to all other clients.
+        for (const other of this.clients)
+            if (other !== client)
+                this.sendJoinMessage(other, client);
+
+        // If a second player joined, start a new game.
+        if (secondPlayerJoined)
+            this.beginCountdown();
+    }
+
+    // Handle a message from a client.
+    message(client: Player, data: Uint8Array) {
+        const reader = new MessageReader(data);
+        const type = reader.u8();
+        switch (type) {
+            case MessageType.Move: return this.handleMoveMessage(client, reader);
+            case MessageType.Collect: return this.handleCollectMessage(client, reader);
+            default: return this.log(`Unrecognized message type: ${type}`);
+        }
+    }
+
+    // Remove a client that disconnected.
+    quit(client: Player) {
+        this.log(client.name, "disconnected");
+        this.clients.delete(client);
+        this.grid.remove(client);
+        for (const other of this.clients) {
+            other.withheld.delete(client);
+            other.near.delete(client);
+        }
+        if (this.nextMatchTimer !== 0)
+            this.players.delete(client);
+        this.broadcastMessage(new MessageWriter().u8(MessageType.Quit).varint(client.id).finish());
+
+        // When there's only one player left...
+        if (this.clients.size === 1) {
+
+            // If a game was about to start, cancel it.
+            if (this.nextMatchTimer !== 0) {
+                this.log("Only one player left, match cancelled!");
+                clearTimeout(this.nextMatchTimer);
+                this.nextMatchTimer = 0;
+
+            // Otherwise, the remaining player receives all remaining gems.
+            } else {
+                this.log("All but one player left, match ends!");
+                const lastPlayer = this.clients.values().next().value!;
+                lastPlayer.score += countBitsSet(this.gemMask);
+                this.broadcastCollectMessage(lastPlayer, -1);
+                this.endMatch();
+            }
+        }
+
+        // When all players leave, reset the game completely.
+        if (this.clients.size === 0) {
+            if (this.nextMatchTimer !== 0) {
+                this.log("All players disconnected!");
+                clearTimeout(this.nextMatchTimer);
+                this.nextMatchTimer = 0;
+            }
+            this.players.clear();
+            this.gemMask = 0n;
+        }
+    }
+}
+
+// Lobbies running on this worker, and the client on each socket (with its
+// lobby). Lobbies are removed once everyone has left.
+const lobbies = new Map<number, Lobby>();
+const sockets = new Map<number, [Player, Lobby]>();
+
+onmessage = (event: MessageEvent<LobbyMessage>) => {
+    const message = event.data;
+    if (message.type === "join") {
+        let lobby = lobbies.get(message.lobby);
+        if (!lobby) {
+            lobby = new Lobby(message.lobby);
+            lobbies.set(lobby.id, lobby);
+        }
+        const client: Player = {
+            socket: message.socket, id: message.id, name: message.name, score: 0, move: null, changed: 0,
+            moving: false, distantChanged: 0, cell: -1, near: new Set(), blocked: false, withheld: new Map(), withheldBytes: 0,
+        };
+        sockets.set(client.socket, [client, lobby]);
+        return lobby.join(client);
+    }
+    const entry = sockets.get(message.socket);
+    if (!entry)
+        return;
+    const [client, lobby] = entry;
+    switch (message.type) {
+        case "message": return lobby.message(client, message.data);
+        case "blocked": client.blocked = true; return;
+        case "drain": return lobby.drain(client);
+        case "quit":
+            sockets.delete(client.socket);
+            lobby.quit(client);
+            if (lobby.clients.size === 0)
+                lobbies.delete(lobby.id);
+            return;
+    }
+};
+
+setInterval(() => {
+    for (const lobby of lobbies.values())
+        lobby.tick();
+}, 1000 / TICK_RATE);
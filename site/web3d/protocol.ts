@@ -0,0 +1,210 @@
+// Encoding of the messages exchanged between the engine and the game server
+// (see src/protocol.c, which has the same functions). Every message starts
+// with a type byte. Player IDs, scores and gem indices are LEB128 varints
+// (zigzag encoded when they can be negative), positions are 16-bit fixed point
+// fractions of the map size, headings are 8-bit fractions of a turn, and
+// timestamps are doubles. Everything is little-endian.
+//
+// The first message from a client logs in, and is the protocol version, the
+// user ID and the user name. The server closes connections from clients that
+// speak another version of the protocol. Clients keep their clock in sync with
+// the server's by sending pings, which the server answers right away.
+
+// Version of the protocol (this should match PROTOCOL_VERSION in web3d.h).
+export const PROTOCOL_VERSION = 3;
+
+// Message types (these should match the MESSAGE_* values in web3d.h).
+export enum MessageType {
+    Join = 0, // varint id, varint score, name
+    Quit,     // varint id
+    Begin,    // varint self, varint ghost, f64 timestamp, varint gems
+    Count,    // f64 timestamp
+    End,
+    Move,     // u8 fields, then the fields present
+    Collect,  // (varint id,) zigzag gem index (, varint score)
+    Catch,
+    Snapshot, // f64 timestamp, then varint id, u8 fields and the fields, per player
+    Ping,     // f64 client timestamp
+    Pong,     // f64 client timestamp (from the ping), f64 server timestamp
+}
+
+// Fields present in a move, which only has the ones that changed since the
+// last move of the same player. Clients send their own moves, and the server
+// sends the moves of every player that moved in a snapshot, each after the
+// player's ID.
+export enum MoveField {
+    X = 1 << 0,       // u16 x
+    Y = 1 << 1,       // u16 y
+    Heading = 1 << 2, // u8 heading
+    All = X | Y | Heading,
+}
+
+// Quantized position and heading of a player.
+export type MoveState = { x: number; y: number; heading: number };
+
+// Dimensions of the map, in tiles (these should match web3d.h).
+export const MAP_W = 25;
+export const MAP_H = 25;
+
+// Get the coordinate (in tiles) that a quantized coordinate stands for.
+export function dequantizePosition(q: number, size: number) {
+    return q * (size / 65535);
+}
+
+// Growable buffer that messages are written to. Varints are written with
+// arithmetic rather than bitwise operators, so that they can hold any safe
+// integer (such as the 50-bit gem mask).
+export class MessageWriter {
+    bytes = new Uint8Array(64);
+    view = new DataView(this.bytes.buffer);
+    length = 0;
+
+    reserve(size: number) {
+        if (this.length + size <= this.bytes.length)
+            return;
+        const bytes = new Uint8Array(Math.max(this.bytes.length * 2, this.length + size));
+        bytes.set(this.bytes.subarray(0, this.length));
+        this.bytes = bytes;
+        this.view = new DataView(bytes.buffer);
+    }
+
+    u8(value: number) {
+        this.reserve(1);
+        this.bytes[this.length++] = value;
+        return this;
+    }
+
+    u16(value: number) {
+        this.reserve(2);
+        this.view.setUint16(this.length, value, true);
+        this.length += 2;
+        return this;
+    }
+
+    f64(value: number) {
+        this.reserve(8);
+        this.view.setFloat64(this.length, value, true);
+        this.length += 8;
+        return this;
+    }
+
+    varint(value: number) {
+        for (; value >= 0x80; value = Math.floor(value / 0x80))
+            this.u8(value % 0x80 + 0x80);
+        return this.u8(value);
+    }
+
+    zigzag(value: number) {
+        return this.varint(value < 0 ? -value * 2 - 1 : value * 2);
+    }
+
+    append(bytes: Uint8Array) {
+        this.reserve(bytes.length);
+        this.bytes.set(bytes, this.length);
+        this.length += bytes.length;
+        return this;
+    }
+
+    string(value: string) {
+        return this.append(new TextEncoder().encode(value));
+    }
+
+    // Write the fields of a move that are set in `fields`.
+    move(fields: number, state: MoveState) {
+        this.u8(fields);
+        if (fields & MoveField.X)
+            this.u16(state.x);
+        if (fields & MoveField.Y)
+            this.u16(state.y);
+        if (fields & MoveField.Heading)
+            this.u8(state.heading);
+        return this;
+    }
+
+    finish() {
+        return this.bytes.slice(0, this.length);
+    }
+}
+
+// Position in a message being read. Reads past the end return zeros and set
+// `error`, so that a message only needs to be checked once it's been read.
+export class MessageReader {
+    bytes: Uint8Array;
+    view: DataView;
+    offset = 0;
+    error = false;
+
+    constructor(bytes: Uint8Array) {
+        this.bytes = bytes;
+        this.view = new DataView(bytes.buffer, bytes.byteOffset, bytes.byteLength);
+    }
+
+    get done() {
+        return this.offset >= this.bytes.length;
+    }
+
+    read(size: number) {
+        if (this.offset + size > this.bytes.length) {
+            this.error = true;
+            return -1;
+        }
+        this.offset += size;
+        return this.offset - size;
+    }
+
+    u8() {
+        const offset = this.read(1);
+        return offset < 0 ? 0 : this.bytes[offset];
+    }
+
+    u16() {
+        const offset = this.read(2);
+        return offset < 0 ? 0 : this.view.getUint16(offset, true);
+    }
+
+    f64() {
+        const offset = this.read(8);
+        return offset < 0 ? 0 : this.view.getFloat64(offset, true);
+    }
+
+    varint() {
+        let value = 0;
+        for (let scale = 1; scale <= Number.MAX_SAFE_INTEGER; scale *= 0x80) {
+            const byte = this.u8();
+            value += (byte % 0x80) * scale;
+            if (byte < 0x80)
+                return value;
+        }
+        this.error = true;
+        return 0;
+    }
+
+    zigzag() {
+        const value = this.varint();
+        return value % 2 ? -(value + 1) / 2 : value / 2;
+    }
+
+    // Read a number of bytes, as a view of the message.
+    raw(size: number) {
+        const offset = this.read(size);
+        return offset < 0 ? new Uint8Array(0) : this.bytes.subarray(offset, offset + size);
+    }
+
+    string() {
+        const offset = this.offset;
+        this.offset = this.bytes.length;
+        return new TextDecoder().decode(this.bytes.subarray(offset));
+    }
+
+    // Read a move into a state, and return its fields.
+    move(state: MoveState) {
+        const fields = this.u8();
+        if (fields & MoveField.X)
+            state.x = this.u16();
+        if (fields & MoveField.Y)
+            state.y = this.u16();
+        if (fields & MoveField.Heading)
+            state.heading = this.u8();
+        return fields;
+    }
+}
@@ -1,134 +1,151 @@
 import type { ServerWebSocket } from "bun";
-import { recordMatch } from "../utils/recordMatch.ts";
-
-enum MessageType {
-    Join = 0,
-    Quit,
-    Begin,
-    Count,
-    End,
-    Move,
-    Collect,
-    Catch,
-}
+import { MessageReader, MessageType, MessageWriter, PROTOCOL_VERSION } from "./protocol.ts";
+import type { LobbyMessage, ServerMessage } from "./lobby.ts";
 
 // Server configuration.
 const PORT = 3002; // Port used for the server.
 const KEY = `${import.meta.dir}/../../certs/key.pem`;
 const CERT = `${import.meta.dir}/../../certs/cert.pem`;
-const MATCH_COUNTDOWN = 5; // Length of countdown for a match, in seconds.
-const MAX_GEMS = 50n; // Gems to collect per match.
-const ALL_GEMS = (1n << MAX_GEMS) - 1n; // Bit mask for all gems.
-const MAX_PLAYER_NAME = 32; // Maximum player name length.
-
-// server state.
-const clients = new Set<ServerWebSocket>; // Currently connected clients.
-let players = new Set<ServerWebSocket>; // Players in the current match.
-let clientIdCounter = 0; // Counter used for assigning client IDs.
-let startTime = Date.now(); // Time of the start of the game (and also the RNG seed).
-let nextMatchTimer = 0; // Timer ID for the start of the next match.
-let nextMatch = startTime; // Timestamp for the start of the next match.
-let gemMask = 0n; // Bit mask of gems that have not been collected.
-let ghostId = 0; // Client ID of the current ghost.
-
-// Count the number of ones in the binary representation of a BigInt.
-function countBitsSet(value: BigInt): number {
-    let count = 0;
-    while (value !== 0n) {
-        count += Number(value & 1n);
-        value >>= 1n;
-    }
-    return count;
-}
-
-// Send a join message.
-function sendJoinMessage(recipient: ServerWebSocket, joined: ServerWebSocket) {
-    const name = joined.name.slice(0, MAX_PLAYER_NAME - 1);
-    const data = Buffer.allocUnsafe(56);
-    data.writeDoubleLE(MessageType.Join, 0);
-    data.writeDoubleLE(joined.id, 8);
-    data.writeDoubleLE(joined.score, 16);
-    data.write(name, 24);
-    data.writeUInt8(0, 24 + name.length);
-    recipient.sendBinary(data);
+const LOBBY_SIZE = 8; // Players per lobby.
+const LOBBY_WORKERS = Math.max(navigator.hardwareConcurrency - 1, 1); // Workers that run lobbies.
+const BACKPRESSURE_LIMIT = 64 * 1024; // Bytes buffered for a client before it counts as slow.
+
+// This thread owns the sockets, and puts each player that logs in into a lobby
+// with room for them (or a new one). Every lobby is a separate match, which
+// runs on one of a pool of workers (see lobby.ts). Messages from a player are
+// passed on to their lobby's worker, and the worker sends back what to send to
+// the players, so the game logic and the encoding of every message run in the
+// workers. The sockets are still written from this thread though, so the cost
+// of sending doesn't scale with the number of workers.
+type Lobby = {
+    id: number;
+    worker: LobbyWorker;
+    size: number; // Number of players.
+};
+type LobbyWorker = {
+    worker: Worker;
+    players: number; // Number of players in the worker's lobbies.
+};
+
+// Outgoing messages of a client. While the client can't keep up (when its
+// socket has more than BACKPRESSURE_LIMIT bytes buffered), messages wait in a
+// queue until it catches up, and its lobby stops sending it snapshots (it gets
+// one with the latest state at the end instead, and the bytes of the
+// snapshots it didn't get are counted as shed).
+type Outbox = {
+    blocked: boolean;     // Whether to wait for the socket to drain.
+    queue: Uint8Array[];  // Messages to send once it drains.
+    sentBytes: number;    // Bytes sent so far.
+    shedBytes: number;    // Bytes of snapshots replaced by later ones.
+};
+
+// Server state.
+const workers: LobbyWorker[] = [];
+const lobbies = new Map<number, Lobby>(); // Lobbies with players in them.
+const sockets = new Map<number, ServerWebSocket>(); // Logged in clients, by socket ID.
+const users = new Set<number>(); // IDs of the users that are logged in.
+let socketIdCounter = 0; // Counter used for assigning socket IDs.
+let lobbyIdCounter = 0; // Counter used for assigning lobby IDs.
+
+// Post a message to the worker that runs a client's lobby.
+function postToLobby(client: ServerWebSocket, message: LobbyMessage) {
+    (client.lobby as Lobby).worker.worker.postMessage(message);
 }
 
-// Send a message to a client.
-function sendMessage(client: ServerWebSocket, ...args: number[]) {
-    client.sendBinary(new Float64Array([...args]));
+// Send a message to a client, unless it can't keep up. Returns false if the
+// message wasn't sent, in which case it's up to the caller to keep it.
+function trySend(client: ServerWebSocket, message: Uint8Array) {
+    const outbox: Outbox = client.outbox;
+    if (outbox.blocked)
+        return false;
+    const status = client.sendBinary(message);
+    if (status <= 0) { // -1 if queued over the limit, 0 if dropped.
+        outbox.blocked = true;
+        postToLobby(client, { type: "blocked", socket: client.socketId });
+    }
+    if (status === 0)
+        return false;
+    outbox.sentBytes += message.length;
+    return true;
 }
 
-// Repeat a message for all connected clients.
-function repeatMessage(message: Float64Array) {
-    for (const client of clients)
-        client.sendBinary(message);
+// Send a message to a client, keeping it until the client catches up if needed
+// (as a copy, so that the batch the message came in isn't kept with it).
+function sendMessage(client: ServerWebSocket, message: Uint8Array) {
+    if (!trySend(client, message))
+        client.outbox.queue.push(message.slice());
 }
 
-// Broadcast a message to all connected clients.
-function broadcastMessage(...args: number[]) {
-    repeatMessage(new Float64Array([...args]));
+// Send the messages that were kept for a client, once its socket drains, and
+// let its lobby know that it caught up.
+function flushOutbox(client: ServerWebSocket) {
+    const outbox: Outbox = client.outbox;
+    outbox.blocked = false;
+    while (outbox.queue.length > 0) {
+        if (!trySend(client, outbox.queue[0]))
+            return;
+        outbox.queue.shift();
+    }
+    postToLobby(client, { type: "drain", socket: client.socketId });
 }
 
-// Handle a player movement message from a client.
-function handleMoveMessage(message: Float64Array) {
-    repeatMessage(message);
+// Find a lobby with room for another player, or start a new one on the worker
+// with the fewest players.
+function findLobby() {
+    for (const lobby of lobbies.values())
+        if (lobby.size < LOBBY_SIZE)
+            return lobby;
+    const worker = workers.reduce((a, b) => b.players < a.players ? b : a);
+    const lobby = { id: ++lobbyIdCounter, worker, size: 0 };
+    lobbies.set(lobby.id, lobby);
+    return lobby;
 }
 
-// Start a new match.
-function startMatch() {
-    nextMatchTimer = 0;
-    startTime = Date.now();
-    gemMask = ALL_GEMS;
-    for (const client of clients) {
-        client.score = 0;
-        sendMessage(client, MessageType.Begin, client.id, ghostId, startTime, Number(gemMask));
+// Handle a message from a lobby worker.
+function handleLobbyMessage(event: MessageEvent<ServerMessage>) {
+    const message = event.data;
+    switch (message.type) {
+        case "send": {
+            const reader = new MessageReader(new Uint8Array(message.data));
+            while (!reader.done) {
+                const socketId = reader.varint();
+                const data = reader.raw(reader.varint());
+                if (reader.error)
+                    break;
+                const client = sockets.get(socketId);
+                if (client)
+                    sendMessage(client, data);
+            }
+        } return;
+        case "shed": {
+            const client = sockets.get(message.socket);
+            if (client)
+                client.outbox.shedBytes += message.bytes;
+        } return;
     }
-    console.log("A new match started!");
 }
 
-// End a match.
-function endMatch() {
-
-    // Record the results in the database.
-    const playerArray = Array.from(players);
-    const playerIds = playerArray.map(p => p.id);
-    const scores = playerArray.map(p => p.score);
-    recordMatch({game: "web3d", playerIds, scores})
-        .catch(error => console.error(error));
-
-    // Notify the clients that the game ended.
-    players = new Set(clients);
-    broadcastMessage(MessageType.End);
-    gemMask = 0n;
-    console.log("The match ended!");
+// Get the lobby and traffic of each connected client, for the metrics endpoint.
+// The endpoint is public, so clients are only told apart by their position in
+// the list, and not by who they are.
+function clientMetrics() {
+    return Array.from(sockets.values(), client => {
+        const outbox: Outbox = client.outbox;
+        return {
+            lobby: client.lobby.id,
+            blocked: outbox.blocked,
+            queued: outbox.queue.length,
+            sentBytes: outbox.sentBytes,
+            shedBytes: outbox.shedBytes,
+        };
+    });
 }
 
-// Begin the countdown for the next match.
-function beginCountdown() {
-    if (nextMatchTimer === 0) {
-        nextMatch = Date.now() + MATCH_COUNTDOWN * 1000;
-        broadcastMessage(MessageType.Count, nextMatch);
-        nextMatchTimer = setTimeout(startMatch, MATCH_COUNTDOWN * 1000);
-        console.log("Starting a new match in", MATCH_COUNTDOWN, "seconds");
-    }
-}
-
-// Handle a gem collect message from a client.
-function handleCollectMessage(client: ServerWebSocket, message: Float64Array) {
-    const gemIndex = message[2];
-    const gemBit = 1n << BigInt(gemIndex);
-    if ((gemMask & gemBit) && Date.now() >= startTime + 1000) {
-        client.score++;
-        gemMask &= ~gemBit; // Mark the gem as collected.
-        broadcastMessage(MessageType.Collect, client.id, gemIndex, client.score);
-    }
-
-    // Start a new match when all gems have been collected.
-    if (gemMask === 0n && clients.size > 1) {
-        console.log("All gems were collected!");
-        endMatch();
-        beginCountdown();
-    }
+// Start the lobby workers.
+for (let i = 0; i < LOBBY_WORKERS; i++) {
+    const worker = new Worker(new URL("./lobby.ts", import.meta.url));
+    worker.onmessage = handleLobbyMessage;
+    workers.push({ worker, players: 0 });
 }
 
 // Start the WebSocket server.
@@ -140,65 +157,75 @@ const server = Bun.serve({
     },
     // Handle connections to the WebSocket endpoint.
     fetch(request: Request, server) {
-        if (new URL(request.url).pathname === "/web3d") {
+        const path = new URL(request.url).pathname;
+        if (path === "/web3d") {
             server.upgrade(request);
             return;
         }
+        if (path === "/web3d/metrics")
+            return Response.json(clientMetrics());
         return new Response("WebSocket server");
     },
 
     websocket: {
+        backpressureLimit: BACKPRESSURE_LIMIT,
 
         // Handle client → server messages.
         message(client: ServerWebSocket, data: Buffer) {
 
-            // If no ID is set, expect a messages with the ID and name.
-            if (client.id === undefined) {
-
-                // Check that the user is not already connected.
-                const userName = new TextDecoder().decode(data.subarray(8));
-                const userId = data.readDoubleLE(0);
-                const secondPlayerJoined = clients.size === 1;
-                for (const other of clients) {
-                    if (other.id === userId) {
-                        console.log(`Duplicate login for ${userName}`);
-                        return client.close();
-                    }
+            // Answer pings from logged in clients (here rather than in the
+            // lobby, so that the time is as fresh as it can be), and pass other
+            // messages on to their lobby.
+            if (client.id !== undefined) {
+                if (data[0] === MessageType.Ping) {
+                    const reader = new MessageReader(data);
+                    reader.u8();
+                    const time = reader.f64();
+                    if (!reader.error)
+                        sendMessage(client, new MessageWriter().u8(MessageType.Pong).f64(time).f64(Date.now())
+                            .finish());
+                    return;
                 }
-
-                // Add a new client.
-                clients.add(client);
-                players.add(client);
-                client.name = userName;
-                client.id = userId;
-                client.score = 0;
-                console.log(`New login ${client.name} (UID ${client.id})`);
-
-                // Send join and begin messages to the new client.
-                for (const other of players)
-                    sendJoinMessage(client, other);
-                sendMessage(client, MessageType.Begin, client.id, ghostId, startTime, Number(gemMask));
-
-                // Send join messages to all other clients.
-                for (const other of clients)
-                    if (other !== client)
-                        sendJoinMessage(other, client);
-
-                // If a second player joined, start a new game.
-                if (secondPlayerJoined)
-                    beginCountdown();
+                postToLobby(client, { type: "message", socket: client.socketId, data: new Uint8Array(data) });
                 return;
             }
 
-            // Otherwise, parse other types of messages.
-            const message = new Float64Array(data.buffer);
-            const type = message[0];
-            message[1] = client.id; // Set the playerId.
-            switch (type) {
-                case MessageType.Move: return handleMoveMessage(message);
-                case MessageType.Collect: return handleCollectMessage(client, message);
-                default: return console.log(`Unrecognized message type: ${type}`);
+            // Otherwise, expect a message with the protocol version, ID and
+            // name. Check that the client speaks the same protocol.
+            const reader = new MessageReader(data);
+            const version = reader.u8();
+            if (version !== PROTOCOL_VERSION) {
+                console.log(`Unsupported protocol version ${version}`);
+                return client.close();
+            }
+
+            // Check that the user is not already connected.
+            const userId = reader.varint();
+            const userName = reader.string();
+            if (users.has(userId)) {
+                console.log(`Duplicate login for ${userName}`);
+                return client.close();
             }
+
+            // Add the client to a lobby.
+            const lobby = findLobby();
+            lobby.size++;
+            lobby.worker.players++;
+            users.add(userId);
+            client.socketId = ++socketIdCounter;
+            client.id = userId;
+            client.name = userName;
+            client.lobby = lobby;
+            client.outbox = { blocked: false, queue: [], sentBytes: 0, shedBytes: 0 } satisfies Outbox;
+            sockets.set(client.socketId, client);
+            console.log(`New login ${client.name} (UID ${client.id}) in lobby ${lobby.id}`);
+            postToLobby(client, { type: "join", lobby: lobby.id, socket: client.socketId, id: userId, name: userName });
+        },
+
+        // Send what a slow client missed, once it catches up.
+        drain(client: ServerWebSocket) {
+            if (client.outbox)
+                flushOutbox(client);
         },
 
         // Handle client connection.
@@ -208,45 +235,21 @@ const server = Bun.serve({
 
         // Handle client disconnection.
         close(client: ServerWebSocket) {
-            if (!clients.has(client))
+            if (!sockets.has(client.socketId))
                 return;
-            console.log(client.name, "disconnected");
-            clients.delete(client);
-            if (nextMatchTimer !== 0)
-                players.delete(client);
-            broadcastMessage(MessageType.Quit, client.id);
-
-            // When there's only one player left...
-            if (clients.size === 1) {
-
-                // If a game was about to start, cancel it.
-                if (nextMatchTimer !== 0) {
-                    console.log("Only one player left, match cancelled!");
-                    clearTimeout(nextMatchTimer);
-                    nextMatchTimer = 0;
-
-                // Otherwise, the remaining player receives all remaining gems.
-                } else {
-                    console.log("All but one player left, match ends!");
-                    const lastPlayer = clients.values().next().value;
-                    lastPlayer.score += countBitsSet(gemMask);
-                    broadcastMessage(MessageType.Collect, lastPlayer.id, -1, lastPlayer.score);
-                    endMatch();
-                }
-            }
-
-            // When all players leave, reset the game completely.
-            if (clients.size === 0) {
-                if (nextMatchTimer !== 0) {
-                    console.log("All players disconnected!");
-                    clearTimeout(nextMatchTimer);
-                    nextMatchTimer = 0;
-                }
-                players.clear();
-                gemMask = 0n;
-            }
+            const { sentBytes, shedBytes } = client.outbox;
+            console.log(client.name, "disconnected", { sentBytes, shedBytes });
+            sockets.delete(client.socketId);
+            users.delete(client.id);
+            postToLobby(client, { type: "quit", socket: client.socketId });
+
+            // Close the lobby once everyone has left.
+            const lobby: Lobby = client.lobby;
+            lobby.worker.players--;
+            if (--lobby.size === 0)
+                lobbies.delete(lobby.id);
         },
     },
 });
 
-console.log(`Web3D server running at ${server.url}`);
+console.log(`Web3D server running at ${server.url} with ${LOBBY_WORKERS} lobby workers`);
@@ -0,0 +1,421 @@
+#include "web3d.h"
+
+// Assets are decoded from the GIF files embedded below, unless the build has
+// baked them ahead of time (see `tools/bake.c`), in which case the decoded
+// textures and fonts are used straight from the embedded blob.
+#ifdef WEB3D_BAKED
+static _Alignas(16) const uint8_t assets_blob[] = {
+    #embed "../assets.bin"
+};
+Texture texture_floor;
+Texture texture_wall;
+Texture texture_gems;
+Texture texture_barrier;
+Texture texture_ghost;
+Texture texture_guy_back;
+Texture texture_guy_front;
+Texture texture_guy_left;
+Texture texture_guy_right;
+Font font_tiny;
+Font font_big;
+#else
+static const uint8_t floor_gif[] = {
+    #embed "../assets/floor.gif"
+};
+static const uint8_t wall_gif[] = {
+    #embed "../assets/wall.gif"
+};
+static const uint8_t gems_gif[] = {
+    #embed "../assets/gems.gif"
+};
+static const uint8_t barrier_gif[] = {
+    #embed "../assets/barrier.gif"
+};
+static const uint8_t ghost_gif[] = {
+    #embed "../assets/ghost.gif"
+};
+static const uint8_t guy_back_gif[] = {
+    #embed "../assets/guy_back.gif"
+};
+static const uint8_t guy_front_gif[] = {
+    #embed "../assets/guy_front.gif"
+};
+static const uint8_t guy_left_gif[] = {
+    #embed "../assets/guy_left.gif"
+};
+static const uint8_t guy_right_gif[] = {
+    #embed "../assets/guy_right.gif"
+};
+static const uint8_t font_tiny_gif[] = {
+    #embed "../assets/font_tiny.gif"
+};
+static const uint8_t font_big_gif[] = {
+    #embed "../assets/font_big.gif"
+};
+Texture texture_floor = { .data = (void*) floor_gif, .size = sizeof(floor_gif) };
+Texture texture_wall = { .data = (void*) wall_gif, .size = sizeof(wall_gif) };
+Texture texture_gems = { .data = (void*) gems_gif, .size = sizeof(gems_gif) };
+Texture texture_barrier = { .data = (void*) barrier_gif, .size = sizeof(barrier_gif) };
+Texture texture_ghost = { .data = (void*) ghost_gif, .size = sizeof(ghost_gif) };
+Texture texture_guy_back = { .data = (void*) guy_back_gif, .size = sizeof(guy_back_gif) };
+Texture texture_guy_front = { .data = (void*) guy_front_gif, .size = sizeof(guy_front_gif) };
+Texture texture_guy_left = { .data = (void*) guy_left_gif, .size = sizeof(guy_left_gif) };
+Texture texture_guy_right = { .data = (void*) guy_right_gif, .size = sizeof(guy_right_gif) };
+Font font_tiny = { .data = (void*) font_tiny_gif, .size = sizeof(font_tiny_gif) };
+Font font_big = { .data = (void*) font_big_gif, .size = sizeof(font_big_gif) };
+#endif
+Texture texture_gem[GEM_TYPES];
+
+// Textures that are loaded from their own image, and fonts. Together with the
+// gems, these are all the assets in a baked blob, in order.
+static Texture* const asset_images[] = {
+    &texture_floor,
+    &texture_wall,
+    &texture_gems,
+    &texture_barrier,
+    &texture_ghost,
+    &texture_guy_back,
+    &texture_guy_front,
+    &texture_guy_left,
+    &texture_guy_right,
+};
+static Font* const asset_fonts[] = {
+    &font_tiny,
+    &font_big,
+};
+#define ASSET_IMAGES (sizeof(asset_images) / sizeof(*asset_images))
+#define ASSET_TEXTURES (ASSET_IMAGES + GEM_TYPES)
+#define ASSET_FONTS (sizeof(asset_fonts) / sizeof(*asset_fonts))
+
+// Get a texture by its index in a baked blob.
+static Texture* asset_texture(size_t index)
+{
+    return index < ASSET_IMAGES ? asset_images[index] : &texture_gem[index - ASSET_IMAGES];
+}
+
+// Layout of a baked blob. It starts with a header that describes every
+// texture and font, where pointers are replaced by byte offsets from the start
+// of the blob, followed by the palettes and texel data that they point to.
+typedef struct {
+    uint16_t w, h;
+    uint8_t shift, levels;
+    uint32_t color;
+    uint32_t palette;
+    uint32_t mips[TEXTURE_LEVELS];
+} PackedTexture;
+
+typedef struct {
+    uint16_t w, h;
+    uint16_t width[FONT_GLYPH_COUNT];
+    uint32_t data;
+} PackedFont;
+
+typedef struct {
+    PackedTexture textures[ASSET_TEXTURES];
+    PackedFont fonts[ASSET_FONTS];
+} PackedAssets;
+
+// Create a texture from a sub-region of an existing texture. The mipmaps are
+// shared too, for as long as the region is made of whole texels of a level
+// (the texels of a level that straddle the edge of the region would mix in
+// the texels around it, like those of the next frame of an animation).
+void texture_sub(Texture* tex, Texture* src, int x, int y, int w, int h)
+{
+    tex->w = w;
+    tex->h = h;
+    tex->shift = src->shift;
+    tex->palette = src->palette;
+    tex->levels = 0;
+    for (int level = 0; level < src->levels && (w >> level) && (h >> level); level++) {
+        if ((x | y | w | h) & ((1 << level) - 1))
+            break;
+        tex->mips[level] = texture_column(src, level, x >> level) + (y >> level);
+        tex->levels++;
+    }
+    tex->data = (uint8_t*) tex->mips[0];
+}
+
+#ifndef WEB3D_BAKED
+// Everything below, up to `assets_unpack()`, is the runtime GIF path, which is
+// also what the bake tool runs to produce a blob.
+
+// Assets are allocated once and live forever.
+static void* asset_alloc(size_t size)
+{
+    static _Alignas(16) char buffer[1 << 18];
+    static size_t position;
+    const size_t alignment = 16;
+    void* result = buffer + position;
+    position = (position + size + alignment - 1) & -alignment;
+    return result;
+}
+
+// Sample a texture using unnormalized texture coordinates (x, y).
+static uint32_t texture_fetch(const Texture* tex, size_t x, size_t y)
+{
+    return x < tex->w && y < tex->h ? tex->palette[texture_column(tex, 0, x)[y]] : 0;
+}
+
+// Initialize the `glyph_width` array for a font texture. Any opaque pixel
+// within a glyph's rectangle counts toward the glyph's visible width.
+void font_load(Font* font)
+{
+    // Load the GIF image.
+    font->w = gif_get_image_w(font->data);
+    font->h = gif_get_image_h(font->data);
+    const size_t size = font->w * font->h * sizeof(uint32_t);
+    uint32_t* pixels = asset_alloc(size);
+    gif_get_pixels(font->data, font->size, pixels, size);
+    font->data = pixels;
+
+    const int glyph_w = font->w / FONT_GLYPHS_PER_ROW;
+    const int glyph_h = font->h / FONT_GLYPHS_PER_COL;
+    for (int i = 0; i < FONT_GLYPH_COUNT; i++) {
+        int glyph_x = i % FONT_GLYPHS_PER_ROW * glyph_w;
+        int glyph_y = i / FONT_GLYPHS_PER_ROW * glyph_h;
+        for (int y = glyph_y; y < glyph_y + glyph_h; y++)
+        for (int x = glyph_x; x < glyph_x + glyph_w; x++)
+            if (pixels[x + y * font->w])
+                font->width[i] = max(font->width[i], x - glyph_x + 1);
+    }
+}
+
+// Get the average color of a texture, not counting transparent pixels.
+static uint32_t average_color(Texture* tex)
+{
+    uint32_t r = 0;
+    uint32_t g = 0;
+    uint32_t b = 0;
+    for (int y = 0; y < tex->h; y++)
+    for (int x = 0; x < tex->w; x++) {
+        uint32_t texel = texture_fetch(tex, x, y);
+        r += texel & 0xff;
+        g += texel >> 8 & 0xff;
+        b += texel >> 16 & 0xff;
+    }
+    r /= tex->w * tex->h;
+    g /= tex->w * tex->h;
+    b /= tex->w * tex->h;
+    return r | (g << 8) | (b << 16) | (0xff << 24);
+}
+
+// Find the palette index of the opaque color closest to (r, g, b).
+static uint8_t palette_nearest(const uint32_t* palette, int r, int g, int b)
+{
+    int best = 0;
+    int best_distance = INT_MAX;
+    for (int i = 0; i < 256; i++) {
+        if (!palette[i])
+            continue;
+        const int dr = (int) (palette[i] & 0xff) - r;
+        const int dg = (int) (palette[i] >> 8 & 0xff) - g;
+        const int db = (int) (palette[i] >> 16 & 0xff) - b;
+        const int distance = dr * dr + dg * dg + db * db;
+        if (distance < best_distance) {
+            best = i;
+            best_distance = distance;
+        }
+    }
+    return best;
+}
+
+// Build the next mipmap level of a texture with a box filter. Each texel is the
+// average of the opaque texels in a 2x2 block of the level above, matched to
+// the nearest palette color, or transparent if most of the block is.
+static void texture_build_level(Texture* tex, int level)
+{
+    const int w = tex->w >> level;
+    const int h = tex->h >> level;
+    uint8_t transparent = 0;
+    for (int i = 0; i < 256; i++) {
+        if (!tex->palette[i]) {
+            transparent = i;
+            break;
+        }
+    }
+    uint8_t* texels = asset_alloc(w << (tex->shift - level));
+    for (int x = 0; x < w; x++)
+    for (int y = 0; y < h; y++) {
+        int r = 0, g = 0, b = 0, opaque = 0;
+        for (int i = 0; i < 4; i++) {
+            const uint32_t color = tex->palette[texture_column(tex, level - 1, x * 2 + i / 2)[y * 2 + i % 2]];
+            if (color) {
+                r += color & 0xff;
+                g += color >> 8 & 0xff;
+                b += color >> 16 & 0xff;
+                opaque++;
+            }
+        }
+        texels[(x << (tex->shift - level)) + y] = opaque < 2 ? transparent :
+            palette_nearest(tex->palette, r / opaque, g / opaque, b / opaque);
+    }
+    tex->mips[level] = texels;
+}
+
+// Load a texture from a GIF file, transposing it into columns, and build its
+// mipmaps. The frames of an animated GIF are laid out side by side, the same
+// way as a sprite sheet.
+void texture_load(Texture* tex)
+{
+    const int frames = gif_get_frame_count(tex->data, tex->size);
+    const int frame_w = gif_get_image_w(tex->data);
+    const int frame_h = gif_get_image_h(tex->data);
+    tex->w = frame_w * frames;
+    tex->h = frame_h;
+    tex->shift = 0;
+    while ((1 << tex->shift) < tex->h)
+        tex->shift++;
+    uint32_t* palette = asset_alloc(256 * sizeof(*palette));
+    uint8_t* rows = asset_alloc(tex->w * tex->h);
+    gif_get_indices(tex->data, tex->size, rows, tex->w * tex->h, palette);
+    uint8_t* texels = asset_alloc(tex->w << tex->shift);
+    for (int frame = 0; frame < frames; frame++)
+    for (int y = 0; y < frame_h; y++)
+    for (int x = 0; x < frame_w; x++)
+        texels[((frame * frame_w + x) << tex->shift) + y] = rows[x + (y + frame * frame_h) * frame_w];
+    tex->palette = palette;
+    tex->data = texels;
+    tex->mips[0] = texels;
+    tex->levels = 1;
+    while (tex->levels < TEXTURE_LEVELS && (tex->w >> tex->levels) && (tex->h >> tex->levels))
+        texture_build_level(tex, tex->levels++);
+}
+
+// State for writing a blob. Every block of memory copied into the blob is
+// remembered, so that pointers into it (like sub-textures of an atlas) can be
+// turned into offsets.
+#define MAX_PACKED_REGIONS 128
+typedef struct {
+    uint8_t* blob;
+    size_t capacity;
+    size_t size;
+    bool overflow;
+    size_t region_count;
+    struct {
+        const uint8_t* data;
+        size_t size;
+        uint32_t offset;
+    } regions[MAX_PACKED_REGIONS];
+} Packer;
+
+// Get the offset of data that has already been copied into the blob, or 0 if
+// it hasn't been.
+static uint32_t pack_find(const Packer* packer, const void* data)
+{
+    const uint8_t* bytes = data;
+    for (size_t i = 0; i < packer->region_count; i++) {
+        const uint8_t* start = packer->regions[i].data;
+        if (bytes >= start && bytes < start + packer->regions[i].size)
+            return packer->regions[i].offset + (bytes - start);
+    }
+    return 0;
+}
+
+// Copy a block of memory into the blob (unless it's already there), and get
+// its offset.
+static uint32_t pack_data(Packer* packer, const void* data, size_t size)
+{
+    const uint32_t found = pack_find(packer, data);
+    if (found)
+        return found;
+    const size_t alignment = 16;
+    const size_t offset = (packer->size + alignment - 1) & -alignment;
+    if (offset + size > packer->capacity || packer->region_count == MAX_PACKED_REGIONS) {
+        packer->overflow = true;
+        return 0;
+    }
+    for (size_t i = 0; i < size; i++)
+        packer->blob[offset + i] = ((const uint8_t*) data)[i];
+    packer->regions[packer->region_count].data = data;
+    packer->regions[packer->region_count].size = size;
+    packer->regions[packer->region_count].offset = offset;
+    packer->region_count++;
+    packer->size = offset + size;
+    return offset;
+}
+
+// Write all loaded assets into a blob that `assets_unpack()` can use in place.
+// Returns the size of the blob, or 0 if it doesn't fit.
+size_t assets_pack(uint8_t* blob, size_t capacity)
+{
+    if (capacity < sizeof(PackedAssets))
+        return 0;
+    Packer packer_state = { .blob = blob, .capacity = capacity, .size = sizeof(PackedAssets) };
+    Packer* packer = &packer_state;
+    PackedAssets* header = (PackedAssets*) blob;
+    for (size_t i = 0; i < ASSET_TEXTURES; i++) {
+        const Texture* tex = asset_texture(i);
+        PackedTexture* packed = &header->textures[i];
+        *packed = (PackedTexture) {
+            .w = tex->w,
+            .h = tex->h,
+            .shift = tex->shift,
+            .levels = tex->levels,
+            .color = tex->color,
+            .palette = pack_data(packer, tex->palette, 256 * sizeof(*tex->palette)),
+        };
+        for (int level = 0; level < tex->levels; level++) {
+            const size_t size = (size_t) (tex->w >> level) << (tex->shift - level);
+            packed->mips[level] = pack_data(packer, tex->mips[level], size);
+        }
+    }
+    for (size_t i = 0; i < ASSET_FONTS; i++) {
+        const Font* font = asset_fonts[i];
+        PackedFont* packed = &header->fonts[i];
+        *packed = (PackedFont) {
+            .w = font->w,
+            .h = font->h,
+            .data = pack_data(packer, font->data, font->w * font->h * sizeof(uint32_t)),
+        };
+        for (int glyph = 0; glyph < FONT_GLYPH_COUNT; glyph++)
+            packed->width[glyph] = font->width[glyph];
+    }
+    return packer->overflow ? 0 : packer->size;
+}
+#endif
+
+// Point all textures and fonts into a blob written by `assets_pack()`. Nothing
+// is decoded or copied.
+void assets_unpack(const uint8_t* blob)
+{
+    const PackedAssets* header = (const PackedAssets*) blob;
+    for (size_t i = 0; i < ASSET_TEXTURES; i++) {
+        Texture* tex = asset_texture(i);
+        const PackedTexture* packed = &header->textures[i];
+        tex->w = packed->w;
+        tex->h = packed->h;
+        tex->shift = packed->shift;
+        tex->levels = packed->levels;
+        tex->color = packed->color;
+        tex->palette = (const uint32_t*) (blob + packed->palette);
+        for (int level = 0; level < tex->levels; level++)
+            tex->mips[level] = blob + packed->mips[level];
+        tex->data = (uint8_t*) tex->mips[0];
+    }
+    for (size_t i = 0; i < ASSET_FONTS; i++) {
+        Font* font = asset_fonts[i];
+        const PackedFont* packed = &header->fonts[i];
+        font->w = packed->w;
+        font->h = packed->h;
+        for (int glyph = 0; glyph < FONT_GLYPH_COUNT; glyph++)
+            font->width[glyph] = packed->width[glyph];
+        font->data = (uint8_t*) blob + packed->data;
+    }
+}
+
+// Load all assets, either from the baked blob or by decoding the GIF files.
+void assets_load(void)
+{
+#ifdef WEB3D_BAKED
+    assets_unpack(assets_blob);
+#else
+    for (size_t i = 0; i < ASSET_IMAGES; i++)
+        texture_load(asset_images[i]);
+    for (size_t i = 0; i < ASSET_FONTS; i++)
+        font_load(asset_fonts[i]);
+    for (int i = 0; i < GEM_TYPES; i++) {
+        texture_sub(&texture_gem[i], &texture_gems, i * 16, 0, 16, 16);
+        texture_gem[i].color = average_color(&texture_gem[i]);
+    }
+#endif
+}
@@ -1,5 +1,26 @@
 #include "web3d.h"
 
+// GIF decoding. Images decode to 8-bit palette indices or to RGBA pixels. The
+// frames of an animated GIF are decoded one after another, so that the output
+// is as tall as all frames stacked on top of each other. All reads are checked
+// against the size of the file and all writes against the size of the output.
+
+// Size of the header and logical screen descriptor.
+#define GIF_HEADER_SIZE 13
+
+// Maximum number of LZW codes.
+#define GIF_MAX_CODES 0x1000
+
+// A frame of a GIF file.
+typedef struct {
+    int x, y, w, h;             // Rectangle covered by the frame.
+    int transparent;            // Transparent color index (or -1 if none).
+    int disposal;               // How to clear the frame before the next one.
+    const uint8_t* palette;     // Local palette (or NULL to use the global one).
+    int palette_size;           // Number of colors in the local palette.
+    const uint8_t* data;        // LZW code size, followed by the data sub-blocks.
+} GifFrame;
+
 int gif_get_image_w(const uint8_t* gif)
 {
     return gif[6] | (gif[7] << 8);
@@ -10,86 +31,249 @@ int gif_get_image_h(const uint8_t* gif)
     return gif[8] | (gif[9] << 8);
 }
 
-void* gif_get_pixels(const uint8_t* gif, void* output)
+// Get the number of colors in the global palette.
+static int gif_palette_size(const uint8_t* gif)
 {
-    // Read the global header and palette (if present).
-    const uint8_t (*palette)[3] = (const uint8_t(*)[3]) (gif + 13);
-    gif += 13 + (gif[10] >> 7) * 3 * (2 << (gif[10] & 7));
-
-    // Read extension blocks.
-    int transparent = -1; // Transparent color index (or -1 if none).
-    while (*gif++ == 0x21) { // Extension introducer.
-        if (*gif++ == 0xf9) { // Graphic control extension.
-            transparent = gif[1] & 1 ? gif[4] : -1; // Transparent index.
-            gif += 6;
-        } else { // Skip over any other extensions.
-            for (int size; (size = *gif++); gif += size);
-        }
+    return gif[10] >> 7 ? 2 << (gif[10] & 7) : 0;
+}
+
+// Skip over a sequence of sub-blocks, up to and including the terminator.
+// Returns NULL if the file ends first.
+static const uint8_t* gif_skip_blocks(const uint8_t* gif, const uint8_t* end)
+{
+    while (gif < end) {
+        const int size = *gif++;
+        if (!size)
+            return gif;
+        if (size > end - gif)
+            return NULL;
+        gif += size;
     }
+    return NULL;
+}
 
-    // Read the local palette (if present).
-    if (gif[8] & 0x80) {
-        palette = (const uint8_t(*)[3]) (gif + 9);
-        gif += 3 * (2 << (gif[8] & 7));
+// Read the frame at `gif`, along with the extension blocks before it. Returns a
+// pointer to the next frame, or NULL at the end of the file or if the frame is
+// malformed.
+static const uint8_t* gif_read_frame(const uint8_t* gif, const uint8_t* end, GifFrame* frame)
+{
+    frame->transparent = -1;
+    frame->disposal = 0;
+    while (gif && gif < end) {
+        switch (*gif++) {
+        case 0x21: // Extension introducer.
+            if (end - gif >= 7 && gif[0] == 0xf9 && gif[1] == 4) { // Graphic control extension.
+                frame->disposal = gif[2] >> 2 & 7;
+                frame->transparent = gif[2] & 1 ? gif[5] : -1;
+            }
+            gif = end - gif >= 1 ? gif_skip_blocks(gif + 1, end) : NULL;
+            break;
+        case 0x2c: // Image descriptor.
+            if (end - gif < 9)
+                return NULL;
+            frame->x = gif[0] | (gif[1] << 8);
+            frame->y = gif[2] | (gif[3] << 8);
+            frame->w = gif[4] | (gif[5] << 8);
+            frame->h = gif[6] | (gif[7] << 8);
+            frame->palette = gif[8] & 0x80 ? gif + 9 : NULL;
+            frame->palette_size = gif[8] & 0x80 ? 2 << (gif[8] & 7) : 0;
+            if (end - gif <= 9 + frame->palette_size * 3)
+                return NULL;
+            gif += 9 + frame->palette_size * 3;
+            frame->data = gif;
+            return gif_skip_blocks(gif + 1, end);
+        default: // Trailer, or something that isn't a GIF block.
+            return NULL;
+        }
     }
-    gif += 9;
+    return NULL;
+}
+
+// Get a pointer to the first block after the header and global palette, or
+// NULL if the file is too short to be a GIF.
+static const uint8_t* gif_skip_header(const uint8_t* gif, size_t size)
+{
+    if (size < GIF_HEADER_SIZE || gif[0] != 'G' || gif[1] != 'I' || gif[2] != 'F')
+        return NULL;
+    const size_t header_size = GIF_HEADER_SIZE + gif_palette_size(gif) * 3;
+    return header_size <= size ? gif + header_size : NULL;
+}
 
+int gif_get_frame_count(const uint8_t* gif, size_t size)
+{
+    const uint8_t* end = gif + size;
+    const uint8_t* block = gif_skip_header(gif, size);
+    int frames = 0;
+    for (GifFrame frame; block && (block = gif_read_frame(block, end, &frame)); frames++);
+    return frames;
+}
+
+// Decode the LZW data of a frame into `count` palette indices. Every string in
+// the code table is a copy of something that was already written out, so each
+// code just keeps the length and position of its string, and decoding it is a
+// forward copy within the output (overlapping, for a code that refers to
+// itself). Returns the number of indices written, which is less than `count` if
+// the data ends early or is corrupt.
+static size_t gif_decode(const uint8_t* gif, const uint8_t* end, uint8_t* output, size_t count)
+{
     // Initialize the code table root.
-    const int root = *gif++;
-    int count = 1 << root;
-    int16_t code_next[0x1000];
-    uint8_t code_value[0x1000];
-    for (int i = 0; i < count; i++) {
-        code_value[i] = i;
-        code_next[i] = -1;
-    }
+    const int root = gif < end ? *gif++ : 0;
+    if (root < 1 || root > 11)
+        return 0;
+    const int clear = 1 << root;
+    uint32_t code_position[GIF_MAX_CODES];
+    uint16_t code_length[GIF_MAX_CODES];
+    for (int i = 0; i < clear; i++)
+        code_length[i] = 1;
 
-    // Extract variable-length LZW codes from length-prefixed sub-blocks.
-    uint8_t* pixels = output;
-    int length = root + 1, bits = 0, part = 0, prev = 0, code = 0, block = 0;
+    size_t position = 0, prev_position = 0;
+    uint32_t part = 0;
+    int next = clear + 2, length = root + 1, bits = 0, prev = -1, block = 0;
     for (;;) {
-        block = (block ? block : *gif++) - 1;
-        part |= *gif++ << bits;
-        for (bits += 8; bits >= length; prev = code) {
-            code = part & ((1 << length) - 1);
-            part >>= length;
-            bits -= length;
-
-            // Handle the clear code.
-            if (code == (1 << root)) {
-                count = code;
-                length = root + 1;
-                continue;
-            }
+        // Extract the next variable-length code from length-prefixed sub-blocks.
+        while (bits < length) {
+            if (!block && (gif >= end || !(block = *gif++)))
+                return position;
+            if (gif >= end)
+                return position;
+            block--;
+            part |= (uint32_t) *gif++ << bits;
+            bits += 8;
+        }
+        const int code = part & ((1 << length) - 1);
+        part >>= length;
+        bits -= length;
 
-            // Handle the end code.
-            if (code == (1 << root) + 1)
-                return output;
-
-            // Traverse a chain of codes, pushing each one on a stack.
-            uint8_t stack[0x1000];
-            int top = code > count;
-            for (int i = code > count ? prev : code; i >= 0; i = code_next[i])
-                stack[top++] = code_value[i];
-            if (code > count)
-                stack[0] = stack[top - 1];
-
-            // Add a new code if there's room in the code table.
-            if (count < 0xfff) {
-                int new_code = ++count;
-                code_next[new_code] = prev;
-                code_value[new_code] = stack[top - 1];
-                length += !(count & (count + 1));
-            }
+        // Handle the clear code.
+        if (code == clear) {
+            next = clear + 2;
+            length = root + 1;
+            prev = -1;
+            continue;
+        }
+
+        // Handle the end code, and codes that aren't in the table yet.
+        if (code == clear + 1 || code > next || (code == next && prev < 0))
+            return position;
+
+        // Write the string. A code that is about to be added is the previous
+        // string followed by its own first index, which the overlapping copy
+        // takes care of.
+        const size_t string_length = code == next ? code_length[prev] + 1u : code_length[code];
+        if (string_length > count - position)
+            return position;
+        uint8_t* pixels = output + position;
+        if (code < clear) {
+            *pixels = code;
+        } else {
+            const uint8_t* string = output + (code == next ? prev_position : code_position[code]);
+            for (size_t i = 0; i < string_length; i++)
+                pixels[i] = string[i];
+        }
+
+        // Add a new code if there's room in the code table.
+        if (prev >= 0 && next < GIF_MAX_CODES) {
+            code_position[next] = prev_position;
+            code_length[next] = code_length[prev] + 1;
+            length += ++next == (1 << length) && length < 12;
+        }
+        prev_position = position;
+        position += string_length;
+        prev = code;
+    }
+}
 
-            // Pop pixels off the stack and write them to the image.
-            while (top--) {
-                const uint8_t* color = palette[stack[top]];
-                *pixels++ = color[0];
-                *pixels++ = color[1];
-                *pixels++ = color[2];
-                *pixels++ = 255 * (stack[top] != transparent);
+// Compose a frame, whose indices are at the end of its slot in the output, over
+// the previous frame (or a cleared image, if there isn't one). The previous
+// frame's rectangle is cleared first, if it asked for that; restoring to the
+// frame before it (disposal 3) is treated as leaving the frame in place. The
+// index for each pixel is always at or after the pixel itself, so going front
+// to back reads it before anything overwrites it.
+static void gif_compose(uint8_t* canvas, const uint8_t* base, int w, int h, const uint8_t* indices,
+                        const GifFrame* frame, const GifFrame* prev, int clear)
+{
+    const bool dispose = prev->disposal == 2;
+    for (int y = 0; y < h; y++) {
+        uint8_t* row = canvas + y * w;
+        const uint8_t* base_row = base ? base + y * w : NULL;
+        const bool dispose_row = dispose && y >= prev->y && y < prev->y + prev->h;
+        const bool frame_row = y >= frame->y && y < frame->y + frame->h;
+        const uint8_t* source = frame_row ? indices + (y - frame->y) * frame->w : NULL;
+        for (int x = 0; x < w; x++) {
+            const bool cleared = !base_row || (dispose_row && x >= prev->x && x < prev->x + prev->w);
+            int index = -1;
+            if (frame_row && x >= frame->x && x < frame->x + frame->w)
+                index = source[x - frame->x];
+            row[x] = index >= 0 && index != frame->transparent ? index : cleared ? clear : base_row[x];
+        }
+    }
+}
+
+int gif_get_indices(const uint8_t* gif, size_t size, uint8_t* output, size_t output_size, uint32_t palette_rgba[256])
+{
+    const uint8_t* end = gif + size;
+    const uint8_t* block = gif_skip_header(gif, size);
+    if (!block)
+        return 0;
+    const int w = gif_get_image_w(gif);
+    const int h = gif_get_image_h(gif);
+    const size_t frame_size = (size_t) w * h;
+
+    int frames = 0;
+    int clear = 0;           // Index that cleared pixels are set to.
+    GifFrame prev = { 0 };   // Previous frame, for its disposal method.
+    for (GifFrame frame; (block = gif_read_frame(block, end, &frame)); frames++) {
+        if ((frames + 1) * frame_size > output_size)
+            break;
+
+        // Convert the palette of the first frame to RGBA. The transparent color
+        // is all zeros. Later frames are assumed to share the same palette.
+        if (!frames) {
+            const uint8_t (*palette)[3] = (const uint8_t(*)[3]) (frame.palette ? frame.palette : gif + GIF_HEADER_SIZE);
+            const int palette_size = frame.palette ? frame.palette_size : gif_palette_size(gif);
+            for (int i = 0; i < 256; i++) {
+                const uint8_t* color = palette[i];
+                palette_rgba[i] = i >= palette_size || i == frame.transparent ? 0 :
+                    color[0] | (color[1] << 8) | (color[2] << 16) | (0xffu << 24);
             }
+            clear = frame.transparent >= 0 ? frame.transparent : gif[11];
         }
+
+        // Frames that don't fit inside the image are clipped away entirely.
+        if (frame.x + frame.w > w || frame.y + frame.h > h)
+            frame.w = frame.h = 0;
+
+        // Decode the frame's indices into the end of its slot in the output,
+        // and fill in whatever is missing if the data is cut short.
+        uint8_t* canvas = output + frames * frame_size;
+        const size_t count = (size_t) frame.w * frame.h;
+        uint8_t* indices = canvas + frame_size - count;
+        const int fill = frame.transparent >= 0 ? frame.transparent : clear;
+        for (size_t i = gif_decode(frame.data, end, indices, count); i < count; i++)
+            indices[i] = fill;
+
+        // Compose the frame over the previous one, unless it's a first frame
+        // that covers the whole image, which is already in place.
+        const uint8_t* base = frames ? canvas - frame_size : NULL;
+        if (base || count != frame_size || (frame.transparent >= 0 && frame.transparent != clear))
+            gif_compose(canvas, base, w, h, indices, &frame, &prev, clear);
+        prev = frame;
     }
+    return frames;
+}
+
+int gif_get_pixels(const uint8_t* gif, size_t size, void* output, size_t output_size)
+{
+    // Decode the palette indices into the last quarter of the output, then
+    // expand them to RGBA from front to back. Each index is read before the
+    // pixel it becomes overwrites it.
+    const size_t capacity = output_size / sizeof(uint32_t);
+    uint32_t* pixels = output;
+    uint8_t* indices = (uint8_t*) output + capacity * 3;
+    uint32_t palette[256];
+    const int frames = gif_get_indices(gif, size, indices, capacity, palette);
+    const size_t count = frames ? frames * (size_t) gif_get_image_w(gif) * gif_get_image_h(gif) : 0;
+    for (size_t i = 0; i < count; i++)
+        pixels[i] = palette[indices[i]];
+    return frames;
 }
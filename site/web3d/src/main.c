@@ -1,21 +1,28 @@
 #include "web3d.h"
 
-// Dimensions of the frame buffer.
+#ifdef __wasm_simd128__
+#include <wasm_simd128.h>
+#endif
+
+// Default dimensions of the frame buffer. The projection is tuned for this
+// size, and scaled to match when rendering at another resolution.
 #define FRAME_W 360
 #define FRAME_H 200
 
+// Limits for the dimensions of the frame buffer.
+#define MIN_FRAME_W 64
+#define MIN_FRAME_H 36
+#define MAX_FRAME_W 1280
+#define MAX_FRAME_H 720
+
 #define FOV 1.0f
 #define WALL_HEIGHT 150
 
-// Layout of font images.
-#define FONT_GLYPH_MIN ' '
-#define FONT_GLYPH_MAX '~'
-#define FONT_GLYPH_COUNT (FONT_GLYPH_MAX - FONT_GLYPH_MIN + 1)
-#define FONT_GLYPHS_PER_ROW 16
-#define FONT_GLYPHS_PER_COL 6
-
-// How close the player must get to a gem to collect it.
+// How close the player must get to a gem to collect it, and how long after
+// the start of a match (in milliseconds) gems can be collected (this should
+// match COLLECT_DELAY in lobby.ts).
 #define PLAYER_REACH 1.0f
+#define COLLECT_DELAY 1000.0
 
 // The physical size of the player when testing for wall collisions.
 #define PLAYER_HITBOX_SIZE 0.5f
@@ -24,6 +31,13 @@
 #define PLAYER_RUN_SPEED 5.0
 #define PLAYER_TURN_SPEED 2.5
 
+// Other players are drawn where they were this long ago (in milliseconds), by
+// interpolating between the states received from the server, so that there's
+// usually a state on either side. When states are late, positions are
+// extrapolated for at most PLAYER_EXTRAPOLATION, and then eased back.
+#define PLAYER_INTERPOLATION_DELAY 150.0
+#define PLAYER_EXTRAPOLATION 100.0
+
 enum {
     KEY_FORWARD,
     KEY_BACK,
@@ -34,8 +48,67 @@ enum {
     KEY_MAX
 };
 
+// Current dimensions of the frame buffer, and the projection that goes with
+// them. Set by `resize_frame()`.
+static int frame_w;
+static int frame_h;
+static float frame_scale; // Vertical scale relative to FRAME_H.
+static float view_fov;    // Horizontal field of view, adjusted for aspect ratio.
+static float wall_height; // Half the height of a wall at depth 1, in pixels.
+
 // Frame buffer.
-static uint32_t frame[FRAME_W * FRAME_H];
+static uint32_t* frame;
+
+// Copy of the last 3D view without the user interface on top. It's only kept
+// when there were no sprites in view, so that the view can be reused for as long
+// as the camera doesn't move.
+static uint32_t* view_copy;
+static bool view_copy_valid;
+
+// A rectangle of the frame buffer.
+typedef struct {
+    int32_t x, y, w, h;
+} Rect;
+
+// Rectangles covered by the user interface in the current and the previous
+// frame. Whatever is drawn is added to the current list, merging overlapping
+// rectangles as it goes.
+#define MAX_UI_RECTS 32
+static Rect ui_rects[MAX_UI_RECTS];
+static int ui_rect_count;
+static Rect prev_ui_rects[MAX_UI_RECTS];
+static int prev_ui_rect_count;
+
+// Regions of the frame buffer that changed in the last frame (exported for
+// presenting only those). When the 3D view was drawn, this is the whole frame;
+// when it was reused, it's just the user interface of this and the previous
+// frame.
+static struct {
+    int32_t count;
+    Rect rects[MAX_UI_RECTS * 2];
+} dirty;
+
+// Color, light and depth of every pixel, stored column by column. The floor
+// and sky are drawn into these a tile of rows at a time; then each column draws
+// walls and sprites on top of them.
+static uint32_t* column_color;
+static float* column_light;
+static float* column_depth;
+
+// Distance to the floor (or sky) for each row. This only depends on the row,
+// so it's computed whenever the resolution changes. Distances are capped, so
+// that the floor and sky coordinates fit in 16.16 fixed point.
+#define ROW_DISTANCE_MAX 4096.0f
+static float* row_distance;
+
+// The 3D view (without the user interface) as of the last frame each column
+// was shaded in, stored column by column for interlaced rendering. Each column
+// also remembers which frame that was, the depth of its nearest wall, and
+// whether any sprites were drawn in it.
+static uint32_t* history_color;
+static uint32_t* history_frame;
+static float* history_wall;
+static bool* history_sprites;
 
 // Keyboard state.
 static bool key_up[KEY_MAX];
@@ -52,15 +125,66 @@ static float player_angle_smooth;
 static float player_x_smooth;
 static float player_y_smooth;
 
+// Camera state for the frame being rendered (read by all render threads).
+static float view_x, view_y;    // Ray origin.
+static float view_dx, view_dy;  // View direction.
+
+// Camera state for the previous frame.
+static float prev_view_x, prev_view_y;
+static float prev_view_dx, prev_view_dy;
+static bool prev_view_ghost;    // Whether it was drawn for the ghost.
+
+// Interlaced rendering. When it's enabled, each frame only shades every other
+// column, alternating between odd and even columns, and fills in the rest by
+// reprojecting the previous frame.
+static bool interlaced;       // Set by `set_interlaced()`.
+static bool frame_interlaced; // Whether the frame being rendered is interlaced.
+static uint32_t frame_count;  // Number of frames rendered so far.
+
+// Phases of a frame that the profiler measures. The first few follow each other
+// in `draw()` and add up to the total; the column pass is broken down further
+// by the phases after the total, which add up the time of every thread.
+enum {
+    PHASE_INPUT,
+    PHASE_COLLISION,
+    PHASE_NETWORK,
+    PHASE_UPDATE,
+    PHASE_PARTICLES,
+    PHASE_BIN,
+    PHASE_ROWS,
+    PHASE_COLUMNS,
+    PHASE_UI,
+    PHASE_TOTAL,
+    PHASE_WALLS,
+    PHASE_SPRITES,
+    PHASE_FOG,
+    PHASE_REPROJECT,
+    PHASE_MAX
+};
+
+// Profiling. Phases are only timed while the overlay is shown (toggled with the
+// P key) or `set_profiling()` has turned profiling on.
+#define KEY_PROFILE 'P'
+static bool profile_enabled; // Set by `set_profiling()`.
+static bool profile_overlay; // Whether the overlay is shown.
+static bool profiling;       // Whether the frame being rendered is profiled.
+
 // Player state.
 #define MAX_PLAYERS 64
 #define MAX_PLAYER_NAME 32
+#define PLAYER_STATES 8
+typedef struct {
+    double time;    // Server time of the state.
+    float x, y;     // Map position.
+} PlayerState;
 typedef struct {
     uint64_t gems;  // Bit mask of collected gems.
     uint32_t id;    // Unique ID.
     float x, y;     // Map position.
     float vx, vy;   // Visual position.
     float dx, dy;   // Direction vector.
+    PlayerState states[PLAYER_STATES]; // Latest states (state i is in states[i % PLAYER_STATES]).
+    uint32_t state_count; // Number of states received.
     bool moving;    // True if player is in motion.
     bool moved;     // False until the player moves for the first time.
     bool active;    // False if the player disconnected.
@@ -83,18 +207,13 @@ static double time_elapsed; // Total time since the start (in seconds).
 static double time_match;   // Timestamp for the current/next match.
 static double time_next_match;  // Timestamp for the next match.
 static double time_now;     // Timestamp for the current frame.
+static double time_server;  // Estimated server time for the current frame.
+static double time_server_offset; // Server time minus local time (in milliseconds), from pings.
+static double time_snapshot_offset; // Server time of the snapshots arriving now minus local time.
 static float time_delta;    // Time delta since the last frame (in seconds).
 
-// Textures.
-typedef struct {
-    uint16_t w, h;  // Size of the texture.
-    uint16_t pitch; // Texels per row.
-    uint32_t color; // Average color (used for particle effects).
-    void* data;     // GIF file data (before load) or texel data (after load).
-} Texture;
-
 // Gems.
-#define GEM_TYPES 14
+#define GEM_WIDTH 0.4f
 #define MAX_GEMS 50
 #define ALL_GEMS ((1ull << MAX_GEMS) - 1)
 typedef struct {
@@ -118,49 +237,6 @@ typedef struct {
 static Particle particle_array[MAX_PARTICLES];
 static int particle_count;
 
-static Texture texture_floor = { .data = (uint8_t[]) {
-    #embed "../assets/floor.gif"
-}};
-static Texture texture_wall = { .data = (uint8_t[]) {
-    #embed "../assets/wall.gif"
-}};
-static Texture texture_gems = { .data = (uint8_t[]) {
-    #embed "../assets/gems.gif"
-}};
-static Texture texture_barrier = { .data = (uint8_t[]) {
-    #embed "../assets/barrier.gif"
-}};
-static Texture texture_ghost = { .data = (uint8_t[]) {
-    #embed "../assets/ghost.gif"
-}};
-static Texture texture_guy_back = { .data = (uint8_t[]) {
-    #embed "../assets/guy_back.gif"
-}};
-static Texture texture_guy_front = { .data = (uint8_t[]) {
-    #embed "../assets/guy_front.gif"
-}};
-static Texture texture_guy_left = { .data = (uint8_t[]) {
-    #embed "../assets/guy_left.gif"
-}};
-static Texture texture_guy_right = { .data = (uint8_t[]) {
-    #embed "../assets/guy_right.gif"
-}};
-static Texture texture_gem[GEM_TYPES];
-
-// Fonts.
-typedef struct {
-    uint16_t w, h;                      // Size of the font texture.
-    uint16_t width[FONT_GLYPH_COUNT];   // Per-glyph width.
-    void* data;                         // GIF or texel data (same as Texture).
-} Font;
-
-static Font font_tiny = { .data = (uint8_t[]) {
-    #embed "../assets/font_tiny.gif"
-}};
-static Font font_big = { .data = (uint8_t[]) {
-    #embed "../assets/font_big.gif"
-}};
-
 // Check if a map tile is a wall. Coordinates outside of the map are treated as
 // walls.
 static bool is_wall(int x, int y)
@@ -168,7 +244,7 @@ static bool is_wall(int x, int y)
     return map_get(x, y) > 0;
 }
 
-static float raycast(float ax, float ay, float bx, float by, float t)
+[[maybe_unused]] static float raycast(float ax, float ay, float bx, float by, float t)
 {
     int ix = floor(ax), sx = (bx > 0.0f) - (bx < 0.0f);
     int iy = floor(ay), sy = (by > 0.0f) - (by < 0.0f);
@@ -187,6 +263,119 @@ static float raycast(float ax, float ay, float bx, float by, float t)
     return 1e9f;
 }
 
+// A wall boundary crossed by a ray.
+typedef struct {
+    float depth;    // Ray parameter at the crossing.
+    float x, y;     // Map position of the crossing.
+} RayHit;
+
+// Trace a ray from (ax, ay) in direction (bx, by) and record the wall
+// boundaries it crosses, in order, in a single traversal. Each hit lies
+// strictly beyond the previous one, so the list matches what repeated calls
+// to `raycast()` would return. The steps are counted from the origin for all
+// hits together, like each call to `raycast()` does, so a crossing more than
+// 100 tiles away is missed either way. If the ray runs out before `max_hits`
+// crossings are found, the list ends with a miss at depth 1e9. Returns the hit
+// count.
+static int raycast_hits(float ax, float ay, float bx, float by, RayHit* hits, int max_hits)
+{
+    int ix = floor(ax), sx = (bx > 0.0f) - (bx < 0.0f);
+    int iy = floor(ay), sy = (by > 0.0f) - (by < 0.0f);
+    float dx = abs(1 / bx), tx = dx * ((sx > 0) - sx * fract(ax));
+    float dy = abs(1 / by), ty = dy * ((sy > 0) - sy * fract(ay));
+    float last = 0.0f;
+    bool wall_prev = is_wall(ix, iy);
+    int count = 0;
+    for (int l = 0; l < 100 && count < max_hits; l++) {
+        int axis = !sy || tx < ty;
+        ix += sx * axis;
+        iy += sy * !axis;
+        float depth = min(tx, ty);
+        bool inside = map_inside(ix, iy);
+        bool wall = is_wall(ix, iy);
+        if (depth > last && (!inside || wall != wall_prev)) {
+            hits[count++] = (RayHit) {depth, ax + bx * depth, ay + by * depth};
+            last = depth;
+        }
+        wall_prev = wall;
+        tx += dx * axis;
+        ty += dy * !axis;
+    }
+    if (count < max_hits)
+        hits[count++] = (RayHit) {1e9f, ax + bx * 1e9f, ay + by * 1e9f};
+    return count;
+}
+
+// Number of nearby rays that are traced together by `raycast_packet()`.
+#define PACKET_SIZE 4
+
+// Trace a packet of rays from a shared origin (ax, ay) in directions (bx, by),
+// writing the depth of each ray's first wall boundary past t[i] to hit[i]. The
+// results are the same as calling `raycast()` for each ray.
+static void raycast_packet(float ax, float ay, const float bx[PACKET_SIZE], const float by[PACKET_SIZE],
+                           const float t[PACKET_SIZE], float hit[PACKET_SIZE])
+{
+#ifdef __wasm_simd128__
+    const v128_t zero = wasm_f32x4_splat(0.0f);
+    const v128_t vbx = wasm_v128_load(bx);
+    const v128_t vby = wasm_v128_load(by);
+    const v128_t vt = wasm_v128_load(t);
+
+    // Step direction of each ray along the x and y axes (-1, 0 or 1).
+    const v128_t sx = wasm_i32x4_sub(wasm_f32x4_lt(vbx, zero), wasm_f32x4_gt(vbx, zero));
+    const v128_t sy = wasm_i32x4_sub(wasm_f32x4_lt(vby, zero), wasm_f32x4_gt(vby, zero));
+    const v128_t sx_pos = wasm_f32x4_convert_i32x4(wasm_v128_and(sx, wasm_i32x4_gt(sx, wasm_i32x4_splat(0))));
+    const v128_t sy_pos = wasm_f32x4_convert_i32x4(wasm_v128_and(sy, wasm_i32x4_gt(sy, wasm_i32x4_splat(0))));
+
+    // Ray parameter step per grid cell, and distance to the first grid line.
+    const v128_t one = wasm_f32x4_splat(1.0f);
+    const v128_t dx = wasm_f32x4_abs(wasm_f32x4_div(one, vbx));
+    const v128_t dy = wasm_f32x4_abs(wasm_f32x4_div(one, vby));
+    const v128_t fx = wasm_f32x4_mul(wasm_f32x4_convert_i32x4(sx), wasm_f32x4_splat(fract(ax)));
+    const v128_t fy = wasm_f32x4_mul(wasm_f32x4_convert_i32x4(sy), wasm_f32x4_splat(fract(ay)));
+    v128_t tx = wasm_f32x4_mul(dx, wasm_f32x4_sub(sx_pos, fx));
+    v128_t ty = wasm_f32x4_mul(dy, wasm_f32x4_sub(sy_pos, fy));
+
+    // All rays start in the same cell. The wall state of the previous cell is
+    // carried along, so each step only needs one map lookup per ray.
+    v128_t ix = wasm_i32x4_splat(floor(ax));
+    v128_t iy = wasm_i32x4_splat(floor(ay));
+    v128_t wall_prev = wasm_i32x4_splat(-is_wall(floor(ax), floor(ay)));
+    v128_t result = wasm_f32x4_splat(1e9f);
+    v128_t done = wasm_i32x4_splat(0);
+    for (int l = 0; l < 100 && !wasm_i32x4_all_true(done); l++) {
+        v128_t axis = wasm_v128_or(wasm_i32x4_eq(sy, wasm_i32x4_splat(0)), wasm_f32x4_lt(tx, ty));
+        ix = wasm_i32x4_add(ix, wasm_v128_and(sx, axis));
+        iy = wasm_i32x4_add(iy, wasm_v128_andnot(sy, axis));
+
+        // Look up the cells the rays stepped into.
+        v128_t cell = wasm_i32x4_make(
+            map_get(wasm_i32x4_extract_lane(ix, 0), wasm_i32x4_extract_lane(iy, 0)),
+            map_get(wasm_i32x4_extract_lane(ix, 1), wasm_i32x4_extract_lane(iy, 1)),
+            map_get(wasm_i32x4_extract_lane(ix, 2), wasm_i32x4_extract_lane(iy, 2)),
+            map_get(wasm_i32x4_extract_lane(ix, 3), wasm_i32x4_extract_lane(iy, 3)));
+        v128_t wall = wasm_i32x4_gt(cell, wasm_i32x4_splat(0));
+        v128_t outside = wasm_i32x4_lt(cell, wasm_i32x4_splat(0));
+        v128_t boundary = wasm_v128_or(outside, wasm_v128_xor(wall, wall_prev));
+        wall_prev = wall;
+
+        // Record the hit for rays that crossed a boundary past their minimum
+        // depth, and mask them out from then on.
+        v128_t depth = wasm_f32x4_pmin(ty, tx);
+        v128_t found = wasm_v128_andnot(wasm_v128_and(wasm_f32x4_gt(depth, vt), boundary), done);
+        result = wasm_v128_bitselect(depth, result, found);
+        done = wasm_v128_or(done, found);
+
+        tx = wasm_f32x4_add(tx, wasm_v128_and(dx, axis));
+        ty = wasm_f32x4_add(ty, wasm_v128_andnot(dy, axis));
+    }
+    wasm_v128_store(hit, result);
+#else
+    for (int i = 0; i < PACKET_SIZE; i++)
+        hit[i] = raycast(ax, ay, bx[i], by[i], t[i]);
+#endif
+}
+
 // Map a KeyboardEvent keyCode number to an input key.
 static unsigned int key_index(int keycode)
 {
@@ -216,6 +405,8 @@ void keyup(int keycode)
 __attribute__((export_name("keydown")))
 void keydown(int keycode)
 {
+    if (keycode == KEY_PROFILE)
+        profile_overlay = !profile_overlay;
     int index = key_index(keycode);
     if (index < KEY_MAX) {
         key_down[index] = true;
@@ -224,127 +415,114 @@ void keydown(int keycode)
 }
 
 // Very stupid and simple arena allocator.
-static void* malloc(size_t size)
+typedef struct {
+    char* buffer;
+    size_t position;
+} Arena;
+
+static void* arena_alloc(Arena* arena, size_t size)
 {
     const size_t alignment = 16;
-    static char buffer[1 << 18];
-    static size_t position;
-    void* result = buffer + position;
-    position = (position + size + alignment - 1) & -alignment;
+    void* result = arena->buffer + arena->position;
+    arena->position = (arena->position + size + alignment - 1) & -alignment;
     return result;
 }
 
-// Sample a texture using unnormalized texture coordinates (x, y).
-static uint32_t texture_fetch(const Texture* tex, size_t x, size_t y)
+// Sample a mipmap level of a tiling texture using unnormalized texture
+// coordinates (x, y) for that level, wrapping around at the edges.
+static uint32_t texture_fetch_wrap(const Texture* tex, int level, size_t x, size_t y)
 {
-    uint32_t* pixels = (uint32_t*) tex->data;
-    return x < tex->w && y < tex->h ? pixels[x + y * tex->pitch] : 0;
+    const size_t w = tex->w >> level;
+    const size_t h = tex->h >> level;
+    return tex->palette[texture_column(tex, level, x & (w - 1))[y & (h - 1)]];
 }
 
-// Sample a texture using normalized texture coordinates (u, v).
-static uint32_t texture_sample(const Texture* tex, float u, float v)
+// Pick the mipmap level of a texture to use when each pixel covers `scale`
+// texels of level 0: the largest level where a pixel still covers at least one
+// texel.
+static int texture_level(const Texture* tex, float scale)
 {
-    int x = floor(tex->w * u);
-    int y = floor(tex->h * v);
-    return texture_fetch(tex, x, y);
+    int level = 0;
+    for (; scale >= 2.0f && level + 1 < tex->levels; scale *= 0.5f)
+        level++;
+    return level;
 }
 
-// Initialize the `glyph_width` array for a font texture. Any opaque pixel
-// within a glyph's rectangle counts toward the glyph's visible width.
-void font_load(Font* font)
+// Add a rectangle that the user interface is drawn in to the current list.
+static void add_ui_rect(int x0, int y0, int x1, int y1)
 {
-    // Load the GIF image.
-    font->w = gif_get_image_w(font->data);
-    font->h = gif_get_image_h(font->data);
-    uint32_t* pixels = malloc(font->w * font->h * sizeof(*pixels));
-    font->data = gif_get_pixels(font->data, pixels);
-
-    const int glyph_w = font->w / FONT_GLYPHS_PER_ROW;
-    const int glyph_h = font->h / FONT_GLYPHS_PER_COL;
-    for (int i = 0; i < FONT_GLYPH_COUNT; i++) {
-        int glyph_x = i % FONT_GLYPHS_PER_ROW * glyph_w;
-        int glyph_y = i / FONT_GLYPHS_PER_ROW * glyph_h;
-        for (int y = glyph_y; y < glyph_y + glyph_h; y++)
-        for (int x = glyph_x; x < glyph_x + glyph_w; x++)
-            if (pixels[x + y * font->w])
-                font->width[i] = max(font->width[i], x - glyph_x + 1);
-    }
-}
+    x0 = max(0, x0);
+    y0 = max(0, y0);
+    x1 = min(x1, frame_w);
+    y1 = min(y1, frame_h);
+    if (x0 >= x1 || y0 >= y1)
+        return;
 
-// Get the average color of a texture, not counting transparent pixels.
-static uint32_t average_color(Texture* tex)
-{
-    uint32_t r = 0;
-    uint32_t g = 0;
-    uint32_t b = 0;
-    uint8_t (*pixels)[4] = tex->data;
-    for (int y = 0; y < tex->h; y++)
-    for (int x = 0; x < tex->w; x++) {
-        uint8_t* pixel = pixels[x + y * tex->pitch];
-        if (pixel[0] + pixel[1] + pixel[2]) {
-            r += pixel[0];
-            g += pixel[1];
-            b += pixel[2];
-        }
+    // Merge the rectangle into the last one if they overlap (which they do for
+    // text and its shadow), or if the list is full.
+    Rect* last = ui_rect_count ? &ui_rects[ui_rect_count - 1] : NULL;
+    if (last && (ui_rect_count == MAX_UI_RECTS ||
+        (x0 <= last->x + last->w && x1 >= last->x && y0 <= last->y + last->h && y1 >= last->y))) {
+        const int last_x1 = last->x + last->w;
+        const int last_y1 = last->y + last->h;
+        last->x = min(last->x, x0);
+        last->y = min(last->y, y0);
+        last->w = max(last_x1, x1) - last->x;
+        last->h = max(last_y1, y1) - last->y;
+        return;
     }
-    r /= tex->w * tex->h;
-    g /= tex->w * tex->h;
-    b /= tex->w * tex->h;
-    return r | (g << 8) | (b << 16) | (0xff << 24);
-}
-
-// Load a texture from a GIF file.
-void texture_load(Texture* tex)
-{
-    tex->w = gif_get_image_w(tex->data);
-    tex->h = gif_get_image_h(tex->data);
-    tex->data = gif_get_pixels(tex->data, malloc(tex->w * tex->h * 4));
-    tex->pitch = tex->w;
-}
-
-// Create a texture from a sub-region of an existing texture.
-void texture_sub(Texture* tex, Texture* src, int x, int y, int w, int h)
-{
-    tex->w = w;
-    tex->h = h;
-    tex->data = (uint32_t*) src->data + x + y * src->pitch;
-    tex->pitch = src->pitch;
+    ui_rects[ui_rect_count++] = (Rect) { x0, y0, x1 - x0, y1 - y0 };
 }
 
 void texture_draw(Texture* tex, int x, int y)
 {
-    uint32_t* pixels = tex->data;
-    const int x0 = max(0, min(x, FRAME_W));
-    const int y0 = max(0, min(y, FRAME_H));
-    const int x1 = min(x0 + tex->w, FRAME_W);
-    const int y1 = min(y0 + tex->h, FRAME_H);
-    for (int y = y0; y < y1; y++)
+    const int x0 = max(0, min(x, frame_w));
+    const int y0 = max(0, min(y, frame_h));
+    const int x1 = min(x0 + tex->w, frame_w);
+    const int y1 = min(y0 + tex->h, frame_h);
+    add_ui_rect(x0, y0, x1, y1);
     for (int x = x0; x < x1; x++) {
-        uint32_t texel = pixels[(x - x0) + (y - y0) * tex->pitch];
-        if (texel)
-            frame[x + y * FRAME_W] = texel;
+        const uint8_t* texels = texture_column(tex, 0, x - x0);
+        for (int y = y0; y < y1; y++) {
+            uint32_t texel = tex->palette[texels[y - y0]];
+            if (texel)
+                frame[x + y * frame_w] = texel;
+        }
     }
 }
 
 void font_draw_glyph(Font* font, int dx, int dy, int x, int y, int w, int h, uint32_t color)
 {
     uint32_t* pixels = (uint32_t*) font->data + x + y * font->w;
-    const int x0 = max(0, min(dx, FRAME_W));
-    const int y0 = max(0, min(dy, FRAME_H));
-    const int x1 = min(x0 + w, FRAME_W);
-    const int y1 = min(y0 + h, FRAME_H);
+    const int x0 = max(0, min(dx, frame_w));
+    const int y0 = max(0, min(dy, frame_h));
+    const int x1 = min(x0 + w, frame_w);
+    const int y1 = min(y0 + h, frame_h);
     for (int y = y0; y < y1; y++)
     for (int x = x0; x < x1; x++) {
         uint32_t texel = pixels[(x - x0) + (y - y0) * font->w];
         if (texel)
-            frame[x + y * FRAME_W] = texel & color;
+            frame[x + y * frame_w] = texel & color;
     }
 }
 
+int font_width(Font* font, const char* string)
+{
+    int width = 0;
+    while (*string != '\0') {
+        int glyph = *string++ - FONT_GLYPH_MIN;
+        if (glyph < 0 || glyph >= FONT_GLYPH_COUNT)
+            glyph = '?' - FONT_GLYPH_MIN;
+        width += font->width[glyph] + 1;
+    }
+    return width - !width;
+}
+
 void font_draw(Font* font, int x, int y, uint32_t color, const char* string)
 {
     const int rect_w = font->w / FONT_GLYPHS_PER_ROW;
     const int rect_h = font->h / FONT_GLYPHS_PER_COL;
+    add_ui_rect(x, y, x + font_width(font, string), y + rect_h);
     while (*string != '\0') {
         int glyph = *string++ - FONT_GLYPH_MIN;
         if (glyph < 0 || glyph >= FONT_GLYPH_COUNT)
@@ -359,18 +537,6 @@ void font_draw(Font* font, int x, int y, uint32_t color, const char* string)
     }
 }
 
-int font_width(Font* font, const char* string)
-{
-    int width = 0;
-    while (*string != '\0') {
-        int glyph = *string++ - FONT_GLYPH_MIN;
-        if (glyph < 0 || glyph >= FONT_GLYPH_COUNT)
-            glyph = '?' - FONT_GLYPH_MIN;
-        width += font->width[glyph] + 1;
-    }
-    return width - !width;
-}
-
 void respawn(void)
 {
     // Place the player in a random room.
@@ -396,7 +562,7 @@ static void draw_messages(void)
         Message* message = &messages[index];
         if (time_now < message->timestamp + MESSAGE_DELAY * 1000.0) {
             int x = 5;
-            int y = FRAME_H - 30 - 8 * i;
+            int y = frame_h - 30 - 8 * i;
             font_draw(&font_tiny, x + 1, y + 1, 0xff000000, message->text);
             font_draw(&font_tiny, x + 0, y + 0, 0xffffffff, message->text);
         }
@@ -455,28 +621,36 @@ static void new_game(double timestamp, uint64_t gems)
     respawn();
 }
 
+void set_resolution(int w, int h);
+
 // Initialize the game.
 __attribute__((export_name("init")))
 void init(void)
 {
     // Load assets.
-    texture_load(&texture_floor);
-    texture_load(&texture_wall);
-    texture_load(&texture_gems);
-    texture_load(&texture_barrier);
-    texture_load(&texture_ghost);
-    texture_load(&texture_guy_front);
-    texture_load(&texture_guy_left);
-    texture_load(&texture_guy_right);
-    texture_load(&texture_guy_back);
-    font_load(&font_tiny);
-    font_load(&font_big);
-    for (int i = 0; i < GEM_TYPES; i++) {
-        texture_sub(&texture_gem[i], &texture_gems, i * 16, 0, 16, 16);
-        texture_gem[i].color = average_color(&texture_gem[i]);
-    }
+    assets_load();
+
+    // Allocate the frame buffer, unless a resolution has already been set.
+    if (!frame)
+        set_resolution(FRAME_W, FRAME_H);
 }
 
+typedef struct {
+    int x;                   // Frame x position.
+    float wall;              // Depth of the nearest opaque wall.
+    float vx, vy;            // View direction.
+    float px, py;            // Ray origin.
+    float dx, dy;            // Ray direction.
+    uint32_t* color;         // Color of each pixel in the column.
+    float* light;            // Light received by each pixel in the column.
+    float* depth;            // Depth of each pixel in the column.
+} Column;
+
+// The fog code is compiled without fast-math optimizations, so that the vector
+// and scalar versions are guaranteed to produce bit-identical results (as are
+// the helpers it calls from math.c, which LTO inlines into it).
+#pragma float_control(precise, on, push)
+
 // Apply fog to a color.
 static uint32_t apply_fog(uint32_t color, float amount, int x, int y)
 {
@@ -488,85 +662,259 @@ static uint32_t apply_fog(uint32_t color, float amount, int x, int y)
     return (r << 0) | (g << 8) | (b << 16) | (0xff << 24);
 }
 
-typedef struct {
-    int x;                   // Frame x position.
-    float vx, vy;            // View direction.
-    float px, py;            // Ray origin.
-    float dx, dy;            // Ray direction.
-    uint32_t color[FRAME_H]; // Color of each pixel in the column.
-    float light[FRAME_H];    // Light received by each pixel in the column.
-    float depth[FRAME_H];    // Depth of each pixel in the column.
-} Column;
+#ifdef __wasm_simd128__
+
+// Vectorized version of `apply_fog()`, for four vertically adjacent pixels
+// starting at (x, y). Every operation is done in the same order as the scalar
+// version (note that min(a, b) is pmin(b, a)), so the results are identical.
+static v128_t apply_fog_x4(v128_t color, v128_t amount, int x, int y)
+{
+    const v128_t zero = wasm_f32x4_splat(0.0f);
+    const v128_t one = wasm_f32x4_splat(1.0f);
+    const v128_t nine = wasm_f32x4_splat(9.0f);
+    const v128_t full = wasm_f32x4_splat(255.0f);
+    amount = wasm_f32x4_pmax(wasm_f32x4_pmin(wasm_f32x4_div(nine, wasm_f32x4_add(amount, nine)), one), zero);
+    amount = wasm_f32x4_sub(one, amount);
+
+    // Dither (same pattern as `dither()`).
+    v128_t fy = wasm_f32x4_make(y, y + 1, y + 2, y + 3);
+    v128_t d = wasm_f32x4_add(wasm_f32x4_mul(wasm_f32x4_splat(0.06711056f), wasm_f32x4_splat(x)),
+                              wasm_f32x4_mul(wasm_f32x4_splat(0.00583715f), fy));
+    d = wasm_f32x4_sub(d, wasm_f32x4_floor(d));
+    d = wasm_f32x4_mul(wasm_f32x4_splat(52.9829189f), d);
+    d = wasm_f32x4_sub(d, wasm_f32x4_floor(d));
+    d = wasm_f32x4_div(wasm_f32x4_mul(d, wasm_f32x4_splat(4.0f)), full);
+    amount = wasm_f32x4_add(amount, d);
+
+    // Blend each channel towards the fog color.
+    const v128_t keep = wasm_f32x4_sub(one, amount);
+    const v128_t mask = wasm_i32x4_splat(0xff);
+    v128_t r = wasm_f32x4_convert_u32x4(wasm_v128_and(color, mask));
+    v128_t g = wasm_f32x4_convert_u32x4(wasm_v128_and(wasm_u32x4_shr(color, 8), mask));
+    v128_t b = wasm_f32x4_convert_u32x4(wasm_v128_and(wasm_u32x4_shr(color, 16), mask));
+    r = wasm_f32x4_add(wasm_f32x4_mul(keep, r), wasm_f32x4_mul(amount, full));
+    g = wasm_f32x4_add(wasm_f32x4_mul(keep, g), wasm_f32x4_mul(amount, wasm_f32x4_splat(215.0f)));
+    b = wasm_f32x4_add(wasm_f32x4_mul(keep, b), wasm_f32x4_mul(amount, wasm_f32x4_splat(185.0f)));
+    r = wasm_u32x4_trunc_sat_f32x4(wasm_f32x4_pmin(r, full));
+    g = wasm_u32x4_trunc_sat_f32x4(wasm_f32x4_pmin(g, full));
+    b = wasm_u32x4_trunc_sat_f32x4(wasm_f32x4_pmin(b, full));
+
+    // Pack the channels into RGBA pixels.
+    v128_t rgba = wasm_v128_or(r, wasm_i32x4_shl(g, 8));
+    rgba = wasm_v128_or(rgba, wasm_i32x4_shl(b, 16));
+    return wasm_v128_or(rgba, wasm_u32x4_splat(0xff000000));
+}
+
+#endif
+
+// Apply fog to a column and write out its pixels to the frame buffer.
+static void shade_column(Column* col, uint32_t* out)
+{
+    int y = 0;
+#ifdef __wasm_simd128__
+    for (; y + 4 <= frame_h; y += 4) {
+        v128_t color = wasm_v128_load(&col->color[y]);
+        v128_t light = wasm_v128_load(&col->light[y]);
+        v128_t rgba = apply_fog_x4(color, light, col->x, y);
+        out[(y + 0) * frame_w] = wasm_u32x4_extract_lane(rgba, 0);
+        out[(y + 1) * frame_w] = wasm_u32x4_extract_lane(rgba, 1);
+        out[(y + 2) * frame_w] = wasm_u32x4_extract_lane(rgba, 2);
+        out[(y + 3) * frame_w] = wasm_u32x4_extract_lane(rgba, 3);
+    }
+#endif
+    for (; y < frame_h; y++)
+        out[y * frame_w] = apply_fog(col->color[y], col->light[y], col->x, y);
+}
+
+#pragma float_control(pop)
 
-static void draw_sky(Column* col)
-{
-    for (int y = 0; y < FRAME_H / 2; y++) {
-        float t = -500 / (y - FRAME_H * 0.5);
-        float u = fract(0.1f * col->px + t * col->dx);
-        float v = fract(0.1f * col->py + t * col->dy);
-        col->color[y] = texture_sample(&texture_wall, u, v);
-        col->light[y] = t * 10.0f;
-        col->depth[y] = t * 10.0f;
-    }
-}
-
-static void draw_floor(Column* col)
-{
-    for (int y = FRAME_H / 2; y < FRAME_H; y++) {
-        float t = WALL_HEIGHT / (y - FRAME_H * 0.5f);
-        float hit_x = col->px + col->dx * t;
-        float hit_y = col->py + col->dy * t;
-        float u = fract(hit_x * 2.0f);
-        float v = fract(hit_y * 2.0f);
-        int tile_x = floor(hit_x);
-        int tile_y = floor(hit_y);
-        if (is_wall(tile_x, tile_y)) {
-            col->color[y] = texture_sample(&texture_wall, u, v);
-            col->light[y] = t;
-        } else {
-            col->color[y] = texture_sample(&texture_floor, u, v);
-            col->light[y] = t * 4.0f;
+// Convert a number to 16.16 fixed point. The number has to be within
+// +-32768 (see ROW_DISTANCE_MAX).
+static int32_t fixed(float x)
+{
+    return x * 65536.0f;
+}
+
+// Sample a mipmap level of a texture using 16.16 fixed point texture
+// coordinates, wrapping around at the edges.
+static uint32_t texture_sample_fixed(const Texture* tex, int level, uint32_t u, uint32_t v)
+{
+    return texture_fetch_wrap(tex, level, u * (tex->w >> level) >> 16, v * (tex->h >> level) >> 16);
+}
+
+// Draw a tile of rows of the sky. The hit position moves linearly across each
+// row, so it is stepped incrementally in fixed point instead of being computed
+// per pixel (wrapping around, which the texture does too). The tile is walked
+// column by column, so that the pixels written one after the other are next to
+// each other in the column buffers.
+#define ROW_TILE 16
+static void draw_sky_rows(int y0, int y1)
+{
+    uint32_t u[ROW_TILE], v[ROW_TILE], du[ROW_TILE], dv[ROW_TILE];
+    int level[ROW_TILE];
+    for (int y = y0; y < y1; y++) {
+        const int i = y - y0;
+        const float t = row_distance[y];
+        const float step = t * view_fov * 2.0f / (frame_w - 1);
+        u[i] = fixed(0.1f * view_x + t * (view_dx + view_dy * view_fov));
+        v[i] = fixed(0.1f * view_y + t * (view_dy - view_dx * view_fov));
+        du[i] = fixed(-view_dy * step);
+        dv[i] = fixed(+view_dx * step);
+        level[i] = texture_level(&texture_wall, step * texture_wall.w);
+    }
+    for (int x = 0; x < frame_w; x++) {
+        uint32_t* color = &column_color[x * frame_h];
+        float* light = &column_light[x * frame_h];
+        float* depth = &column_depth[x * frame_h];
+        for (int y = y0; y < y1; y++) {
+            const int i = y - y0;
+            color[y] = texture_sample_fixed(&texture_wall, level[i], u[i], v[i]);
+            light[y] = row_distance[y] * 10.0f;
+            depth[y] = row_distance[y] * 10.0f;
+            u[i] += du[i];
+            v[i] += dv[i];
         }
-        col->depth[y] = t;
     }
 }
 
-static void draw_walls(Column* col)
+// Draw a tile of rows of the floor, stepping across it the same way as the sky.
+// Floor tiles under walls use the wall texture, and are darker. Every pixel in
+// a row is at the same depth, so the whole row uses the same mipmap level.
+static void draw_floor_rows(int y0, int y1)
 {
-    // Raycast against the map.
-    float depth = 0.0f;
-    int limit = player_self == player_ghost ? 10 : 1;
-    for (int i = 0; i < limit && (depth - 2.0f) * 0.3f < 1.0f; i++) {
-        depth = raycast(col->px, col->py, col->dx, col->dy, depth);
-        const float y0 = FRAME_H * 0.5f + 0.5f - WALL_HEIGHT / depth;
-        const float y1 = FRAME_H * 0.5f + 0.5f + WALL_HEIGHT / depth;
-        const int y0_clamped = max(0, min(y0, FRAME_H));
-        const int y1_clamped = max(0, min(y1, FRAME_H));
-        const float hit_x = col->px + col->dx * depth;
-        const float hit_y = col->py + col->dy * depth;
-        const float eps = 1e-4f;
-        const bool bounds = hit_x > eps && hit_y > eps && hit_x < MAP_W - eps && hit_y < MAP_H - eps;
-
-        // Draw walls.
-        for (int y = y0_clamped; y < y1_clamped; y++) {
-            if (col->depth[y] < depth || (player_self == player_ghost && dither(col->x, y) > (depth - 1.0f) * 1.5f && bounds))
-                continue;
-            float edge_x = abs(fract(hit_x) - 0.5f);
-            float edge_y = abs(fract(hit_y) - 0.5f);
-            float u = fract((edge_x < edge_y ? hit_x : hit_y) * 2.0f);
-            float v = fract(4.0f * (y - y0) / (y1 - y0));
-            Texture* tex = bounds ? &texture_wall : &texture_barrier;
-            col->color[y] = texture_sample(tex, u, v);
-            col->light[y] = depth;
-            col->depth[y] = depth;
+    uint32_t hit_x[ROW_TILE], hit_y[ROW_TILE], dx[ROW_TILE], dy[ROW_TILE];
+    int wall_level[ROW_TILE], floor_level[ROW_TILE];
+    for (int y = y0; y < y1; y++) {
+        const int i = y - y0;
+        const float t = row_distance[y];
+        const float step = t * view_fov * 2.0f / (frame_w - 1);
+        hit_x[i] = fixed(view_x + t * (view_dx + view_dy * view_fov));
+        hit_y[i] = fixed(view_y + t * (view_dy - view_dx * view_fov));
+        dx[i] = fixed(-view_dy * step);
+        dy[i] = fixed(+view_dx * step);
+        wall_level[i] = texture_level(&texture_wall, step * 2.0f * texture_wall.w);
+        floor_level[i] = texture_level(&texture_floor, step * 2.0f * texture_floor.w);
+    }
+    for (int x = 0; x < frame_w; x++) {
+        uint32_t* color = &column_color[x * frame_h];
+        float* light = &column_light[x * frame_h];
+        float* depth = &column_depth[x * frame_h];
+        for (int y = y0; y < y1; y++) {
+            const int i = y - y0;
+            const float t = row_distance[y];
+            const uint32_t u = hit_x[i] << 1;
+            const uint32_t v = hit_y[i] << 1;
+            if (is_wall((int32_t) hit_x[i] >> 16, (int32_t) hit_y[i] >> 16)) {
+                color[y] = texture_sample_fixed(&texture_wall, wall_level[i], u, v);
+                light[y] = t;
+            } else {
+                color[y] = texture_sample_fixed(&texture_floor, floor_level[i], u, v);
+                light[y] = t * 4.0f;
+            }
+            depth[y] = t;
+            hit_x[i] += dx[i];
+            hit_y[i] += dy[i];
         }
+    }
+}
 
-        // Draw shadows.
-        for (int y = y1_clamped; y < FRAME_H; y++) {
-            if (player_self == player_ghost && (dither(col->x, y) > (depth - 1.0f) * 1.5f && bounds))
-                continue;
-            col->light[y] = min(col->light[y], depth + 4.0f * min(1.0f, (y - y1) / (y1 - y0)));
+// Draw the floor and sky of a range of rows, a tile at a time (tiles don't
+// cross the horizon, so each one is all sky or all floor).
+static void draw_rows_range(int y0, int y1)
+{
+    const int horizon = frame_h / 2;
+    while (y0 < y1) {
+        const int end = y0 < horizon && y1 > horizon ? horizon : y1;
+        const int y = end - y0 > ROW_TILE ? y0 + ROW_TILE : end;
+        if (y0 < horizon)
+            draw_sky_rows(y0, y);
+        else
+            draw_floor_rows(y0, y);
+        y0 = y;
+    }
+}
+
+// Draw one layer of walls into a column, at a boundary found by a raycast.
+static void draw_wall(Column* col, const RayHit* hit)
+{
+    const float depth = hit->depth;
+    const float y0 = frame_h * 0.5f + 0.5f - wall_height / depth;
+    const float y1 = frame_h * 0.5f + 0.5f + wall_height / depth;
+    const int y0_clamped = max(0, min(y0, frame_h));
+    const int y1_clamped = max(0, min(y1, frame_h));
+    const float hit_x = hit->x;
+    const float hit_y = hit->y;
+    const float eps = 1e-4f;
+    const bool bounds = hit_x > eps && hit_y > eps && hit_x < MAP_W - eps && hit_y < MAP_H - eps;
+
+    // Draw walls. The whole slice comes from a single column of the texture,
+    // at a mipmap level picked by how many texels (of the four repeats of the
+    // texture) fall on each pixel.
+    const float edge_x = abs(fract(hit_x) - 0.5f);
+    const float edge_y = abs(fract(hit_y) - 0.5f);
+    const float u = fract((edge_x < edge_y ? hit_x : hit_y) * 2.0f);
+    const Texture* tex = bounds ? &texture_wall : &texture_barrier;
+    const int level = texture_level(tex, 4.0f * tex->h / (y1 - y0));
+    const int tex_w = tex->w >> level;
+    const int tex_h = tex->h >> level;
+    const uint8_t* texels = texture_column(tex, level, (int) floor(tex_w * u) & (tex_w - 1));
+    for (int y = y0_clamped; y < y1_clamped; y++) {
+        if (col->depth[y] < depth || (player_self == player_ghost && dither(col->x, y) > (depth - 1.0f) * 1.5f && bounds))
+            continue;
+        float v = fract(4.0f * (y - y0) / (y1 - y0));
+        col->color[y] = tex->palette[texels[(int) floor(tex_h * v) & (tex_h - 1)]];
+        col->light[y] = depth;
+        col->depth[y] = depth;
+    }
+
+    // Draw shadows.
+    for (int y = y1_clamped; y < frame_h; y++) {
+        if (player_self == player_ghost && (dither(col->x, y) > (depth - 1.0f) * 1.5f && bounds))
+            continue;
+        col->light[y] = min(col->light[y], depth + 4.0f * min(1.0f, (y - y1) / (y1 - y0)));
+    }
+}
+
+// Maximum number of wall layers the ghost can see through.
+#define GHOST_MAX_HITS 10
+
+// Draw the walls for a packet of adjacent columns. The first hit of every ray
+// in the packet is traced together. The ghost sees through walls, so it uses
+// a single traversal per column that finds all the walls further back too.
+static void draw_walls(Column* cols, int count)
+{
+    // Draw walls as seen by the ghost, from front to back until they're too
+    // far to be seen through the fog.
+    if (player_self == player_ghost) {
+        for (int i = 0; i < count; i++) {
+            Column* col = &cols[i];
+            col->wall = 1e9f;
+            RayHit hits[GHOST_MAX_HITS];
+            int hit_count = raycast_hits(col->px, col->py, col->dx, col->dy, hits, GHOST_MAX_HITS);
+            float depth = 0.0f;
+            for (int j = 0; j < hit_count && (depth - 2.0f) * 0.3f < 1.0f; j++) {
+                draw_wall(col, &hits[j]);
+                depth = hits[j].depth;
+            }
         }
+        return;
+    }
+
+    // Raycast against the map.
+    float dx[PACKET_SIZE] = {0};
+    float dy[PACKET_SIZE] = {0};
+    float t[PACKET_SIZE] = {0};
+    float depth[PACKET_SIZE];
+    for (int i = 0; i < count; i++) {
+        dx[i] = cols[i].dx;
+        dy[i] = cols[i].dy;
+    }
+    raycast_packet(cols[0].px, cols[0].py, dx, dy, t, depth);
+    for (int i = 0; i < count; i++) {
+        Column* col = &cols[i];
+        RayHit hit = {depth[i], col->px + col->dx * depth[i], col->py + col->dy * depth[i]};
+        col->wall = depth[i];
+        draw_wall(col, &hit);
     }
 }
 
@@ -583,16 +931,16 @@ static void draw_sprite(Column* col, Texture* tex, float sx, float sy, float w,
     if (t < 0.0f)
         return;
 
-    const float y0 = FRAME_H * 0.5f + 0.5f + (WALL_HEIGHT - (h + w) * 160) / t;
-    const float y1 = FRAME_H * 0.5f + 0.5f + (WALL_HEIGHT - (h + 0) * 160) / t;
-    const int y0_clamped = max(0, min(y0, FRAME_H));
-    const int y1_clamped = max(0, min(y1, FRAME_H));
+    const float y0 = frame_h * 0.5f + 0.5f + (wall_height - (h + w) * 160 * frame_scale) / t;
+    const float y1 = frame_h * 0.5f + 0.5f + (wall_height - (h + 0) * 160 * frame_scale) / t;
+    const int y0_clamped = max(0, min(y0, frame_h));
+    const int y1_clamped = max(0, min(y1, frame_h));
 
     // Draw the shadow.
     const float radius = w * shadow_scale * 0.3f;
     if (-0.707f * shadow_scale < s && s < 0.707f * shadow_scale) {
-        for (int y = 0; y < FRAME_H; y++) {
-            float hit_t = WALL_HEIGHT / (y - FRAME_H * 0.5f);
+        for (int y = 0; y < frame_h; y++) {
+            float hit_t = wall_height / (y - frame_h * 0.5f);
             if (hit_t > col->depth[y])
                 continue;
             float hit_x = hit_t * col->dx - px;
@@ -602,14 +950,20 @@ static void draw_sprite(Column* col, Texture* tex, float sx, float sy, float w,
         }
     }
 
-    // Draw the sprite itself.
-    if (-0.5f < s && s < 0.5f) {
+    // Draw the sprite itself, from a single column of the texture at a mipmap
+    // level picked by its projected height.
+    const int level = texture_level(tex, tex->h / (y1 - y0));
+    const int tex_w = tex->w >> level;
+    const int tex_h = tex->h >> level;
+    const int tex_x = floor(tex_w * (0.5f - s));
+    if (-0.5f < s && s < 0.5f && tex_x < tex_w) {
+        const uint8_t* texels = texture_column(tex, level, tex_x);
         for (int y = y0_clamped; y < y1_clamped; y++) {
             if (t > col->depth[y])
                 continue;
-            float u = 0.5f - s;
             float v = (y - y0 + 1.0f) / (y1 - y0);
-            uint32_t color = texture_sample(tex, u, v);
+            int tex_y = floor(tex_h * v);
+            uint32_t color = tex_y < tex_h ? tex->palette[texels[tex_y]] : 0;
             if (color) {
                 col->color[y] = color;
                 col->depth[y] = t;
@@ -698,46 +1052,94 @@ static void update_particles(float dt)
     }
 }
 
-static void update_players(float dt)
+// Move a player's visual position to where they were at a given server time,
+// interpolating between the states around it.
+static void interpolate_player(Player* player, double time)
+{
+    const uint32_t count = player->state_count < PLAYER_STATES ? player->state_count : PLAYER_STATES;
+    const PlayerState* newest = &player->states[(player->state_count - 1) % PLAYER_STATES];
+
+    // Past the newest state, extrapolate from the last two.
+    if (time >= newest->time) {
+        player->vx = newest->x;
+        player->vy = newest->y;
+        const PlayerState* prev = &player->states[(player->state_count - 2) % PLAYER_STATES];
+        if (count < 2 || newest->time <= prev->time)
+            return;
+        const double late = time - newest->time;
+        const double ahead = late < PLAYER_EXTRAPOLATION ? late : 2.0 * PLAYER_EXTRAPOLATION - late;
+        if (ahead > 0.0) {
+            const float t = ahead / (newest->time - prev->time);
+            player->vx += (newest->x - prev->x) * t;
+            player->vy += (newest->y - prev->y) * t;
+        }
+        return;
+    }
+
+    // Otherwise, find the two states around the time (or use the oldest).
+    for (uint32_t i = 1; i < count; i++) {
+        const PlayerState* a = &player->states[(player->state_count - 1 - i) % PLAYER_STATES];
+        const PlayerState* b = &player->states[(player->state_count - i) % PLAYER_STATES];
+        if (a->time <= time) {
+            const float t = (time - a->time) / (b->time - a->time);
+            player->vx = lerp(a->x, b->x, t);
+            player->vy = lerp(a->y, b->y, t);
+            return;
+        }
+    }
+    const PlayerState* oldest = &player->states[(player->state_count - count) % PLAYER_STATES];
+    player->vx = oldest->x;
+    player->vy = oldest->y;
+}
+
+// Update the visual positions of the other players.
+static void update_players(void)
 {
+    const double time = time_now + time_snapshot_offset - PLAYER_INTERPOLATION_DELAY;
     for (size_t i = 0; i < player_count; i++) {
         Player* player = &players[i];
-        player->vx = smooth(player->vx, player->x, 10.0f * dt);
-        player->vy = smooth(player->vy, player->y, 10.0f * dt);
+        if (player->id == player_self || !player->state_count)
+            continue;
+        const float x = player->vx;
+        const float y = player->vy;
+        interpolate_player(player, time);
+        player->moving = abs(player->vx - x) + abs(player->vy - y) > 1e-4f;
     }
 }
 
-static void draw_particles(Column* col)
+// Get the current size of a particle (particles shrink as they age).
+static float particle_width(const Particle* particle)
 {
-    for (int i = 0; i < particle_count; i++) {
+    return particle->size * (1.0f - particle->counter / particle->lifespan * 0.8f);
+}
 
-        // Find the intersection with the particle billboard.
-        Particle* particle = &particle_array[i];
-        const float w = particle->size * (1.0f - particle->counter / particle->lifespan * 0.8f);
-        const float px = particle->x - col->px;
-        const float py = particle->y - col->py;
-        const float scale = -1.0f / (col->dx * col->vx + col->dy * col->vy);
-        const float t = scale * (-px * col->vx - py * col->vy);
-        const float s = scale * (+px * col->dy - py * col->dx) / w;
-        if (t < 0.0f)
-            continue; // No intersection.
-
-        const float y0 = FRAME_H * 0.5f + 0.5f + (WALL_HEIGHT - (particle->z + w) * 160) / t;
-        const float y1 = FRAME_H * 0.5f + 0.5f + (WALL_HEIGHT - (particle->z + 0) * 160) / t;
-        const int y0_clamped = max(0, min(y0, FRAME_H));
-        const int y1_clamped = max(0, min(y1, FRAME_H));
-
-        // Draw the sprite itself.
-        if (-0.5f < s && s < 0.5f) {
-            for (int y = y0_clamped; y < y1_clamped; y++) {
-                if (t > col->depth[y])
-                    continue;
-                float v = (y - y0 + 1.0f) / (y1 - y0) - 0.5f;
-                if (s * s + v * v < 0.25f && dither(col->x, y) > particle->counter / particle->lifespan * 2.0f - 1.0f) {
-                    col->color[y] = particle->color;
-                    col->depth[y] = t;
-                    col->light[y] = t;
-                }
+static void draw_particle(Column* col, const Particle* particle)
+{
+    // Find the intersection with the particle billboard.
+    const float w = particle_width(particle);
+    const float px = particle->x - col->px;
+    const float py = particle->y - col->py;
+    const float scale = -1.0f / (col->dx * col->vx + col->dy * col->vy);
+    const float t = scale * (-px * col->vx - py * col->vy);
+    const float s = scale * (+px * col->dy - py * col->dx) / w;
+    if (t < 0.0f)
+        return; // No intersection.
+
+    const float y0 = frame_h * 0.5f + 0.5f + (wall_height - (particle->z + w) * 160 * frame_scale) / t;
+    const float y1 = frame_h * 0.5f + 0.5f + (wall_height - (particle->z + 0) * 160 * frame_scale) / t;
+    const int y0_clamped = max(0, min(y0, frame_h));
+    const int y1_clamped = max(0, min(y1, frame_h));
+
+    // Draw the sprite itself.
+    if (-0.5f < s && s < 0.5f) {
+        for (int y = y0_clamped; y < y1_clamped; y++) {
+            if (t > col->depth[y])
+                continue;
+            float v = (y - y0 + 1.0f) / (y1 - y0) - 0.5f;
+            if (s * s + v * v < 0.25f && dither(col->x, y) > particle->counter / particle->lifespan * 2.0f - 1.0f) {
+                col->color[y] = particle->color;
+                col->depth[y] = t;
+                col->light[y] = t;
             }
         }
     }
@@ -753,6 +1155,10 @@ static void draw_animation(Column* col, Texture* tex, float x, float y, float w,
     draw_sprite(col, &frame, x, y, w, h);
 }
 
+// Sprite sizes of players and the ghost.
+#define GUY_WIDTH 0.9f
+#define GHOST_WIDTH 1.5f
+
 static void draw_guy(Column* col, float x, float y, float dx, float dy, bool animate)
 {
     Texture* tex = &texture_guy_left;
@@ -765,12 +1171,12 @@ static void draw_guy(Column* col, float x, float y, float dx, float dy, bool ani
     else if (cp < 0.0f)
         tex = &texture_guy_right;
     float rate = animate * 10.0f;
-    draw_animation(col, tex, x, y, 0.9f, 0.0f, rate);
+    draw_animation(col, tex, x, y, GUY_WIDTH, 0.0f, rate);
 }
 
 static void draw_ghost(Column* col, float x, float y)
 {
-    draw_animation(col, &texture_ghost, x, y, 1.5, 0.0f, 10.0f);
+    draw_animation(col, &texture_ghost, x, y, GHOST_WIDTH, 0.0f, 10.0f);
 }
 
 static void draw_countdown(double seconds)
@@ -778,15 +1184,15 @@ static void draw_countdown(double seconds)
     // Draw a timer.
     char text[16];
     string_from_timestamp(text, seconds);
-    int x = FRAME_W - 52;
-    int y = FRAME_H - 16;
+    int x = frame_w - 52;
+    int y = frame_h - 16;
     int color = ((int) (seconds * 128.0f) % 128 + 127) * 0x010101 | 0xff000000;
     font_draw(&font_big, x + 1, y + 1, 0xff000000, text);
     font_draw(&font_big, x + 0, y + 0, color, text);
 
     char* small = "NEXT MATCH IN";
-    x = FRAME_W - 64;
-    y = FRAME_H - 26;
+    x = frame_w - 64;
+    y = frame_h - 26;
     font_draw(&font_tiny, x + 1, y + 1, 0xff000000, small);
     font_draw(&font_tiny, x + 0, y + 0, color, small);
 }
@@ -795,7 +1201,7 @@ static void draw_scores(void)
 {
     // Draw the table heading.
     char* text = "Scores";
-    int x = (FRAME_W - 20) / 2;
+    int x = (frame_w - 20) / 2;
     int y = 30;
     font_draw(&font_big, x + 1, y + 1, 0xff000000, text);
     font_draw(&font_big, x + 0, y + 0, 0xffffffff, text);
@@ -808,7 +1214,7 @@ static void draw_scores(void)
             continue;
 
         // Draw the player name.
-        x = (FRAME_W - 120) / 2;
+        x = (frame_w - 120) / 2;
         y = 51 + count * 14;
         font_draw(&font_tiny, x + 1, y + 1, 0xff000000, player->name);
         font_draw(&font_tiny, x + 0, y + 0, 0xffffffff, player->name);
@@ -817,7 +1223,7 @@ static void draw_scores(void)
         char score[16];
         string_from_int(score, player->score);
         int width = font_width(&font_big, score);
-        x = (FRAME_W + 120) / 2 - width;
+        x = (frame_w + 120) / 2 - width;
         y = 50 + count * 14;
         font_draw(&font_big, x + 1, y + 1, 0xff000000, score);
         font_draw(&font_big, x + 0, y + 0, 0xffffffff, score);
@@ -838,8 +1244,8 @@ static void draw_user_interface(bool logged_in)
     // Tell the user to log in if we're not connected.
     if (!logged_in) {
         char* text = "Log in to play";
-        int x = (FRAME_W - 90) / 2;
-        int y = (FRAME_H - 17) / 2;
+        int x = (frame_w - 90) / 2;
+        int y = (frame_h - 17) / 2;
         font_draw(&font_big, x + 1, y + 1, 0xff000000, text);
         font_draw(&font_big, x + 0, y + 0, 0xffffffff, text);
         return;
@@ -851,24 +1257,24 @@ static void draw_user_interface(bool logged_in)
         char text[16];
         string_from_int(text, player->score);
         int x = 23;
-        int y = 182 + 10.0f * score_shake * sinf(time_elapsed * 80.0f);
+        int y = frame_h - 18 + 10.0f * score_shake * sinf(time_elapsed * 80.0f);
         score_shake = max(0.0f, score_shake - time_delta);
         font_draw(&font_big, x + 1, y + 1, 0xff000000, text);
         font_draw(&font_big, x + 0, y + 0, 0xffffffff, text);
-        texture_draw(&texture_gem[1], 5, 180);
+        texture_draw(&texture_gem[1], 5, frame_h - 20);
     }
 
     // Show some text while waiting for other players to join.
     if (player_active == 1) {
         char* text = "Waiting for players";
-        int x = FRAME_W - 90;
-        int y = FRAME_H - 17;
+        int x = frame_w - 90;
+        int y = frame_h - 17;
         font_draw(&font_tiny, x + 1, y + 1, 0xff000000, text);
         font_draw(&font_tiny, x + 0, y + 0, 0xffffffff, text);
 
     // Draw a countdown while waiting for the next match.
-    } else if (time_now < time_next_match) {
-        draw_countdown((time_next_match - time_now) / 1000.0);
+    } else if (time_server < time_next_match) {
+        draw_countdown((time_next_match - time_server) / 1000.0);
     }
 
     // Draw the scores if there's no active match.
@@ -879,32 +1285,154 @@ static void draw_user_interface(bool logged_in)
     draw_messages();
 }
 
-static void draw_players(Column* col)
+static void draw_player(Column* col, const Player* player)
 {
+    if (player->id == player_ghost)
+        draw_ghost(col, player->vx, player->vy);
+    else
+        draw_guy(col, player->vx, player->vy, player->dx, player->dy, player->moving);
+}
+
+// Get the current height of a gem's bobbing animation.
+static float gem_height(const Gem* gem)
+{
+    return 0.3f + 0.05f * sinf(time_elapsed * 2.0f + gem->phase);
+}
+
+static void draw_gem(Column* col, const Gem* gem)
+{
+    draw_sprite(col, gem->tex, gem->x, gem->y, GEM_WIDTH, gem_height(gem));
+}
+
+// Sprites that may be visible in the current frame, in drawing order. Each
+// sprite is projected once per frame to find the range of columns it can
+// touch (including its shadow), and each column gets a bit mask of the
+// sprites it needs to draw, so the column loop never visits the rest.
+#define MAX_SPRITES (MAX_GEMS + MAX_PARTICLES + MAX_PLAYERS)
+#define SPRITE_WORDS ((MAX_SPRITES + 63) / 64)
+enum {
+    SPRITE_GEM,
+    SPRITE_PARTICLE,
+    SPRITE_PLAYER,
+};
+typedef struct {
+    uint8_t type;   // Kind of object (SPRITE_GEM, SPRITE_PARTICLE, ...).
+    uint8_t index;  // Index into the array of that kind of object.
+    float near;     // Smallest depth the sprite or its shadow can have.
+    float rise;     // Height above the top of the walls (before projection).
+} Sprite;
+static Sprite sprite_array[MAX_SPRITES];
+static int sprite_count;
+static uint64_t* sprite_bins; // SPRITE_WORDS words for each column.
+
+// Project a sprite billboard of width w standing at (x, y), and add it to the
+// bins of all columns where it's within `extent` sprite widths of the ray.
+static void bin_sprite(int type, int index, float x, float y, float w, float top, float extent, float shadow)
+{
+    const float px = x - view_x;
+    const float py = y - view_y;
+    const float dot = view_dx * view_dx + view_dy * view_dy;
+    const float depth = px * view_dx + py * view_dy;
+    const float side = px * view_dy - py * view_dx;
+    if (depth < -1e-3f)
+        return; // Behind the camera.
+
+    // Find the range of ray slopes that pass within the sprite's extent, and
+    // convert it to a range of columns (with a column of margin for rounding).
+    int x0 = 0;
+    int x1 = frame_w;
+    if (depth > 1e-3f) {
+        const float k0 = (-side - extent * dot * w) / depth / view_fov;
+        const float k1 = (-side + extent * dot * w) / depth / view_fov;
+        x0 = max(x0, floor((k0 + 1.0f) * (frame_w - 1) * 0.5f) - 1.0f);
+        x1 = min(x1, floor((k1 + 1.0f) * (frame_w - 1) * 0.5f) + 2.0f);
+    }
+    if (x0 >= x1)
+        return; // Outside of the view.
+
+    const int i = sprite_count++;
+    Sprite* sprite = &sprite_array[i];
+    sprite->type = type;
+    sprite->index = index;
+    sprite->near = depth / dot - shadow;
+    sprite->rise = max(0.0f, (top * 160 - WALL_HEIGHT) * frame_scale);
+    for (int x = x0; x < x1; x++)
+        sprite_bins[x * SPRITE_WORDS + i / 64] |= 1ull << (i % 64);
+}
+
+// Project and bin all sprites for the current frame.
+static void bin_sprites(void)
+{
+    const float shadow_extent = 0.707f * 0.8f; // See `draw_sprite()`.
+    sprite_count = 0;
+    memset(sprite_bins, 0, frame_w * SPRITE_WORDS * sizeof(*sprite_bins));
+    for (int i = 0; i < MAX_GEMS; i++) {
+        if ((gem_mask & (1ull << i))) {
+            const Gem* gem = &gem_array[i];
+            const float h = gem_height(gem);
+            const float shadow = GEM_WIDTH * 0.8f * 0.3f;
+            bin_sprite(SPRITE_GEM, i, gem->x, gem->y, GEM_WIDTH, h + GEM_WIDTH, shadow_extent, shadow);
+        }
+    }
+    for (int i = 0; i < particle_count; i++) {
+        const Particle* particle = &particle_array[i];
+        const float w = particle_width(particle);
+        bin_sprite(SPRITE_PARTICLE, i, particle->x, particle->y, w, particle->z + w, 0.5f, 0.0f);
+    }
     for (size_t i = 0; i < player_count; i++) {
-        Player* player = &players[i];
+        const Player* player = &players[i];
         if (player->id == player_self || !player->active)
             continue;
-        if (player->id == player_ghost)
-            draw_ghost(col, player->vx, player->vy);
-        else
-            draw_guy(col, player->vx, player->vy, player->dx, player->dy, player->moving);
+        const float w = player->id == player_ghost ? GHOST_WIDTH : GUY_WIDTH;
+        bin_sprite(SPRITE_PLAYER, i, player->vx, player->vy, w, w, shadow_extent, w * 0.8f * 0.3f);
     }
 }
 
-static void draw_gems(Column* col)
+// Check whether a sprite lies completely behind a column's nearest wall (and
+// doesn't reach above it), given the wall's depth and projected height.
+static bool sprite_hidden(const Sprite* sprite, float wall, float wall_top)
 {
-    for (int i = 0; i < MAX_GEMS; i++) {
-        if ((gem_mask & (1ull << i))) {
-            Gem* gem = &gem_array[i];
-            float height = 0.3f + 0.05f * sinf(time_elapsed * 2.0f + gem->phase);
-            draw_sprite(col, gem->tex, gem->x, gem->y, 0.4f, height);
+    return sprite->near > wall + 0.01f && sprite->rise / sprite->near + 1.0f < wall_top;
+}
+
+// Check whether any sprites binned to column x can be seen in front of (or
+// above) a wall at the given depth.
+static bool has_sprites(int x, float wall)
+{
+    const float wall_top = wall_height / wall;
+    const uint64_t* bin = &sprite_bins[x * SPRITE_WORDS];
+    for (int word = 0; word < SPRITE_WORDS; word++)
+        for (uint64_t bits = bin[word]; bits; bits &= bits - 1)
+            if (!sprite_hidden(&sprite_array[word * 64 + __builtin_ctzll(bits)], wall, wall_top))
+                return true;
+    return false;
+}
+
+// Draw the sprites binned to a column, skipping the ones hidden behind the
+// column's nearest wall. Returns whether any sprites were drawn.
+static bool draw_sprites(Column* col)
+{
+    bool drawn = false;
+    const float wall_top = wall_height / col->wall;
+    const uint64_t* bin = &sprite_bins[col->x * SPRITE_WORDS];
+    for (int word = 0; word < SPRITE_WORDS; word++) {
+        for (uint64_t bits = bin[word]; bits; bits &= bits - 1) {
+            const Sprite* sprite = &sprite_array[word * 64 + __builtin_ctzll(bits)];
+            if (sprite_hidden(sprite, col->wall, wall_top))
+                continue;
+            switch (sprite->type) {
+                case SPRITE_GEM: draw_gem(col, &gem_array[sprite->index]); break;
+                case SPRITE_PARTICLE: draw_particle(col, &particle_array[sprite->index]); break;
+                case SPRITE_PLAYER: draw_player(col, &players[sprite->index]); break;
+            }
+            drawn = true;
         }
     }
+    return drawn;
 }
 
-__attribute__((export_name("recvJoin")))
-void recv_join(uint32_t id, int score, __externref_t name)
+// Add a player (or bring back one who quit), given their name in UTF-8.
+static void join_player(uint32_t id, int score, const char* name, size_t length)
 {
     // If it's not a returning player, add another player to the array.
     Player* player = get_player_by_id(id);
@@ -917,7 +1445,9 @@ void recv_join(uint32_t id, int score, __externref_t name)
     player->id = id;
     player->score = score;
     player->active = true;
-    string_from_extern(name, player->name, MAX_PLAYER_NAME);
+    length = length < MAX_PLAYER_NAME - 1 ? length : MAX_PLAYER_NAME - 1;
+    memcpy(player->name, name, length);
+    player->name[length] = '\0';
     player_active++;
 
     // Show a join message.
@@ -929,6 +1459,14 @@ void recv_join(uint32_t id, int score, __externref_t name)
     }
 }
 
+__attribute__((export_name("recvJoin")))
+void recv_join(uint32_t id, int score, __externref_t name)
+{
+    char buffer[MAX_PLAYER_NAME];
+    const size_t length = string_from_extern(name, buffer, MAX_PLAYER_NAME);
+    join_player(id, score, buffer, length);
+}
+
 __attribute__((export_name("recvQuit")))
 void recv_quit(uint32_t id)
 {
@@ -1015,22 +1553,31 @@ void recv_end(void)
     gem_mask = 0;
 }
 
+// Add a state of a player, at a given server time. States are kept in order,
+// so a state that isn't newer than the newest one replaces it.
+static void move_player(Player* player, double time, float x, float y, float dx, float dy)
+{
+    player->x = x;
+    player->y = y;
+    player->dx = dx;
+    player->dy = dy;
+    if (!player->moved) {
+        player->vx = player->x;
+        player->vy = player->y;
+        player->state_count = 0;
+    }
+    player->moved = true;
+    if (player->state_count && time <= player->states[(player->state_count - 1) % PLAYER_STATES].time)
+        player->state_count--;
+    player->states[player->state_count++ % PLAYER_STATES] = (PlayerState) { time, x, y };
+}
+
 __attribute__((export_name("recvMove")))
 void recv_move(uint32_t id, float x, float y, float dx, float dy)
 {
     Player* player = get_player_by_id(id);
-    if (player) {
-        player->moving = x != player->x || y != player->y;
-        player->x = x;
-        player->y = y;
-        player->dx = dx;
-        player->dy = dy;
-        if (!player->moved) {
-            player->vx = player->x;
-            player->vy = player->y;
-        }
-        player->moved = true;
-    }
+    if (player)
+        move_player(player, time_now + time_snapshot_offset, x, y, dx, dy);
 }
 
 __attribute__((export_name("recvCollect")))
@@ -1055,30 +1602,983 @@ void recv_collect(uint32_t id, int gem_index, int updated_score)
         score_shake = 0.2f;
 }
 
-// Message types (these should match MessageType in server.ts).
-enum {
-    MESSAGE_MOVE = 5,
-    MESSAGE_COLLECT,
-};
+// Send a message to the server. Returns false if the message couldn't be sent
+// (when the player isn't logged in, or the connection isn't open).
+__attribute__((import_module("islands/Web3D"), import_name("sendMessage")))
+bool send_message(__externref_t socket, const void* data, size_t size);
+
+// Last move sent to the server. Each move only has the fields that changed
+// since the one before, and nothing is sent while the player stands still.
+static struct {
+    bool sent;        // False until the first move is sent.
+    uint16_t x, y;    // Quantized position.
+    uint8_t heading;  // Quantized angle.
+} move_sent;
 
-void send_move(__externref_t socket, float x, float y, float dx, float dy)
+void send_move(__externref_t socket, float x, float y, float angle)
 {
-    __attribute__((import_module("islands/Web3D"), import_name("sendMessage")))
-    void send_move_message(__externref_t, int, int, float, float, float, float);
-    send_move_message(socket, MESSAGE_MOVE, player_self, x, y, dx, dy);
+    const uint16_t qx = quantize_position(x, MAP_W);
+    const uint16_t qy = quantize_position(y, MAP_H);
+    const uint8_t heading = quantize_angle(angle);
+    uint8_t fields = move_sent.sent ? 0 : MOVE_ALL;
+    fields |= qx != move_sent.x ? MOVE_X : 0;
+    fields |= qy != move_sent.y ? MOVE_Y : 0;
+    fields |= heading != move_sent.heading ? MOVE_HEADING : 0;
+    if (!fields)
+        return;
+
+    uint8_t buffer[8];
+    Writer writer = { .data = buffer, .capacity = sizeof(buffer) };
+    write_u8(&writer, MESSAGE_MOVE);
+    write_u8(&writer, fields);
+    if (fields & MOVE_X)
+        write_u16(&writer, qx);
+    if (fields & MOVE_Y)
+        write_u16(&writer, qy);
+    if (fields & MOVE_HEADING)
+        write_u8(&writer, heading);
+    if (send_message(socket, writer.data, writer.size)) {
+        move_sent.sent = true;
+        move_sent.x = qx;
+        move_sent.y = qy;
+        move_sent.heading = heading;
+    }
 }
 
 void send_collect(__externref_t socket, int gem_index)
 {
-    __attribute__((import_module("islands/Web3D"), import_name("sendMessage")))
-    void send_collect_message(__externref_t, int, int, int);
-    send_collect_message(socket, MESSAGE_COLLECT, player_self, gem_index);
+    uint8_t buffer[8];
+    Writer writer = { .data = buffer, .capacity = sizeof(buffer) };
+    write_u8(&writer, MESSAGE_COLLECT);
+    write_zigzag(&writer, gem_index);
+    send_message(socket, writer.data, writer.size);
+}
+
+// Clock synchronization. Every so often, the client sends a ping with its
+// time, and the server answers with a pong that has the same time and its own.
+// Assuming the pong took as long as the ping, the server's clock is ahead by
+// the server time minus the middle of the round trip. Samples from the quickest
+// round trips are the most accurate, so the estimate follows the sample with
+// the shortest round trip of the last few. Pongs are only handled once per
+// frame, so round trips are measured up to a frame too long.
+#define SYNC_SAMPLES 8
+#define SYNC_INTERVAL_FAST 250.0  // Time between pings until there are SYNC_SAMPLES samples.
+#define SYNC_INTERVAL 2000.0      // Time between pings after that.
+static struct {
+    double offsets[SYNC_SAMPLES]; // Sample i is in entry i % SYNC_SAMPLES.
+    double trips[SYNC_SAMPLES];
+    uint32_t count;               // Number of samples so far.
+    double round_trip;            // Smoothed round trip time.
+    double next_ping;             // Time to send the next ping at.
+} clock_sync;
+
+void send_ping(__externref_t socket)
+{
+    if (time_now < clock_sync.next_ping)
+        return;
+    uint8_t buffer[16];
+    Writer writer = { .data = buffer, .capacity = sizeof(buffer) };
+    write_u8(&writer, MESSAGE_PING);
+    write_f64(&writer, time_now);
+    if (send_message(socket, writer.data, writer.size))
+        clock_sync.next_ping = time_now + (clock_sync.count < SYNC_SAMPLES ? SYNC_INTERVAL_FAST : SYNC_INTERVAL);
+}
+
+static void recv_pong(double client_time, double server_time)
+{
+    const double trip = time_now - client_time;
+    if (trip < 0.0)
+        return;
+    clock_sync.offsets[clock_sync.count % SYNC_SAMPLES] = server_time - (client_time + time_now) * 0.5;
+    clock_sync.trips[clock_sync.count % SYNC_SAMPLES] = trip;
+    const bool first = clock_sync.count++ == 0;
+
+    // Find the sample with the shortest round trip, and smooth out the jumps
+    // between samples.
+    const uint32_t count = clock_sync.count < SYNC_SAMPLES ? clock_sync.count : SYNC_SAMPLES;
+    uint32_t best = 0;
+    for (uint32_t i = 1; i < count; i++)
+        if (clock_sync.trips[i] < clock_sync.trips[best])
+            best = i;
+    if (first) {
+        time_server_offset = clock_sync.offsets[best];
+        clock_sync.round_trip = trip;
+    } else {
+        time_server_offset += (clock_sync.offsets[best] - time_server_offset) * 0.25;
+        clock_sync.round_trip += (trip - clock_sync.round_trip) * 0.125;
+    }
+}
+
+// Get the smoothed round trip time to the server in milliseconds (or zero
+// until it's been measured).
+__attribute__((export_name("roundTripTime")))
+double get_round_trip_time(void)
+{
+    return clock_sync.round_trip;
+}
+
+// Messages from the server, queued up by JavaScript as they arrive, and then
+// handled all at once by `draw()`. Each message is kept as it was received
+// (see protocol.c), after an 8-byte header that starts with its size in bytes,
+// and padded to a multiple of 8 bytes.
+#define MESSAGE_QUEUE_SIZE (1 << 16)
+#define MESSAGE_HEADER_SIZE 8
+static struct {
+    uint32_t capacity;  // MESSAGE_QUEUE_SIZE.
+    uint32_t length;    // Number of bytes queued up.
+    _Alignas(8) uint8_t data[MESSAGE_QUEUE_SIZE];
+} message_queue = { .capacity = MESSAGE_QUEUE_SIZE };
+
+// Get the message queue, for adding messages to it from JavaScript. It starts
+// with two 32-bit integers: the size of the queue and the number of bytes in
+// it, followed by the messages.
+__attribute__((export_name("messageQueue")))
+void* get_message_queue(void)
+{
+    return &message_queue;
+}
+
+// Get the size of the queued message at an offset, and the offset of the next.
+// A message that runs past the end of the queue is cut short.
+static uint32_t message_size(uint32_t offset, uint32_t* next)
+{
+    const uint32_t available = message_queue.length - offset;
+    if (available < MESSAGE_HEADER_SIZE) {
+        *next = message_queue.length;
+        return 0;
+    }
+    uint32_t size;
+    memcpy(&size, &message_queue.data[offset], sizeof(size));
+    size = size < available - MESSAGE_HEADER_SIZE ? size : available - MESSAGE_HEADER_SIZE;
+    *next = offset + MESSAGE_HEADER_SIZE + ((size + 7) & ~7u);
+    return size;
+}
+
+// Moves received since they were last handled, merged per player. Moves are
+// deltas, so a later move only overrides the fields it has. Pending moves are
+// all from the snapshot taken at `pending_time` (in server time), since moves
+// from different snapshots are separate states of the players.
+typedef struct {
+    uint32_t id;
+    uint8_t fields;  // MOVE_X, MOVE_Y and MOVE_HEADING.
+    uint16_t x, y;
+    uint8_t heading;
+} Move;
+static Move pending_moves[MAX_PLAYERS];
+static int pending_move_count;
+static double pending_time;
+
+// Handle the pending moves, filling in the fields they don't have from the
+// last known state of each player.
+static void handle_moves(void)
+{
+    for (int i = 0; i < pending_move_count; i++) {
+        const Move* move = &pending_moves[i];
+        Player* player = get_player_by_id(move->id);
+        if (!player)
+            continue;
+        float dx = player->dx;
+        float dy = player->dy;
+        if (move->fields & MOVE_HEADING) {
+            const float angle = dequantize_angle(move->heading);
+            dx = cosf(angle);
+            dy = sinf(angle);
+        }
+        move_player(player, pending_time,
+            move->fields & MOVE_X ? dequantize_position(move->x, MAP_W) : player->x,
+            move->fields & MOVE_Y ? dequantize_position(move->y, MAP_H) : player->y,
+            dx, dy);
+    }
+    pending_move_count = 0;
+}
+
+// Merge a move into the pending move of the same player.
+static void merge_move(const Move* move)
+{
+    int i = 0;
+    while (i < pending_move_count && pending_moves[i].id != move->id)
+        i++;
+    if (i == MAX_PLAYERS) {
+        handle_moves();
+        i = 0;
+    }
+    if (i == pending_move_count)
+        pending_moves[pending_move_count++] = (Move) { .id = move->id };
+    Move* pending = &pending_moves[i];
+    if (move->fields & MOVE_X)
+        pending->x = move->x;
+    if (move->fields & MOVE_Y)
+        pending->y = move->y;
+    if (move->fields & MOVE_HEADING)
+        pending->heading = move->heading;
+    pending->fields |= move->fields;
+}
+
+// Update the server time of the snapshots arriving now from the time of a
+// snapshot that just arrived. The snapshot was taken a bit before it arrived,
+// so the estimate goes up to the latest time right away (which means the
+// snapshot was quick), but only slowly down (so that a late snapshot doesn't
+// throw it off much, but it still follows a clock that drifts).
+static void sync_snapshot_time(double server_time)
+{
+    static bool synced;
+    const double offset = server_time - time_now;
+    if (!synced || offset > time_snapshot_offset)
+        time_snapshot_offset = offset;
+    else
+        time_snapshot_offset += (offset - time_snapshot_offset) * 0.05;
+    synced = true;
+}
+
+// Handle a snapshot from the server, which has the time it was taken, and the
+// fields of each player's move that changed since the last one. The moves are
+// merged into the pending moves of the same snapshot, and handled along with
+// them.
+__attribute__((export_name("recvSnapshot")))
+void recv_snapshot(const uint8_t* data, uint32_t size)
+{
+    Reader reader = { .data = data, .size = size };
+    const double time = read_f64(&reader);
+    if (reader.error)
+        return;
+    sync_snapshot_time(time);
+    if (time != pending_time)
+        handle_moves();
+    pending_time = time;
+    while (reader.offset < reader.size) {
+        Move move = { .id = read_varint(&reader) };
+        move.fields = read_u8(&reader);
+        if (move.fields & MOVE_X)
+            move.x = read_u16(&reader);
+        if (move.fields & MOVE_Y)
+            move.y = read_u16(&reader);
+        if (move.fields & MOVE_HEADING)
+            move.heading = read_u8(&reader);
+        if (reader.error)
+            break;
+        merge_move(&move);
+    }
+}
+
+// Call the handler for a message, if it has all of its arguments. Moves in
+// snapshots are only merged into the pending moves, which are handled before
+// any other message (so that messages still take effect in order).
+static void handle_message(const uint8_t* data, uint32_t size)
+{
+    Reader reader = { .data = data, .size = size };
+    const uint8_t type = read_u8(&reader);
+    if (type == MESSAGE_SNAPSHOT) {
+        recv_snapshot(data + reader.offset, size - reader.offset);
+        return;
+    }
+    handle_moves();
+
+    switch (reader.error ? -1 : type) {
+    case MESSAGE_JOIN: {
+        const uint32_t id = read_varint(&reader);
+        const int score = read_varint(&reader);
+        if (!reader.error)
+            join_player(id, score, (const char*) data + reader.offset, size - reader.offset);
+    } break;
+    case MESSAGE_QUIT: {
+        const uint32_t id = read_varint(&reader);
+        if (!reader.error)
+            recv_quit(id);
+    } break;
+    case MESSAGE_BEGIN: {
+        const uint32_t self = read_varint(&reader);
+        const uint32_t ghost = read_varint(&reader);
+        const double timestamp = read_f64(&reader);
+        const uint64_t gems = read_varint(&reader);
+        if (!reader.error)
+            recv_begin(self, ghost, timestamp, gems);
+    } break;
+    case MESSAGE_COUNT: {
+        const double timestamp = read_f64(&reader);
+        if (!reader.error)
+            recv_count(timestamp);
+    } break;
+    case MESSAGE_END:
+        recv_end();
+        break;
+    case MESSAGE_COLLECT: {
+        const uint32_t id = read_varint(&reader);
+        const int gem_index = read_zigzag(&reader);
+        const int score = read_varint(&reader);
+        if (!reader.error && gem_index < MAX_GEMS)
+            recv_collect(id, gem_index, score);
+    } break;
+    case MESSAGE_PONG: {
+        const double client_time = read_f64(&reader);
+        const double server_time = read_f64(&reader);
+        if (!reader.error)
+            recv_pong(client_time, server_time);
+    } break;
+    }
+}
+
+// Handle every queued message, in order, and empty the queue. Moves of the
+// same player are merged, and handled once.
+__attribute__((export_name("recvMessages")))
+void recv_messages(void)
+{
+    for (uint32_t offset = 0, next; offset < message_queue.length; offset = next) {
+        const uint32_t size = message_size(offset, &next);
+        handle_message(&message_queue.data[offset + MESSAGE_HEADER_SIZE], size);
+    }
+    handle_moves();
+    message_queue.length = 0;
+}
+
+// Get the current time in milliseconds.
+__attribute__((import_module("islands/Web3D"), import_name("getTime")))
+double get_time(void);
+
+// Time spent in each phase of a frame (or part of one), in milliseconds.
+typedef struct {
+    double start;             // End of the last phase.
+    double phases[PHASE_MAX];
+} Profile;
+
+// Timings of the last PROFILE_FRAMES frames, in milliseconds. Frame i is kept
+// in entry i % PROFILE_FRAMES, until it's overwritten.
+#define PROFILE_FRAMES 128
+static struct {
+    uint32_t capacity;  // PROFILE_FRAMES.
+    uint32_t phases;    // PHASE_MAX.
+    uint32_t frames;    // Number of frames profiled so far.
+    float times[PROFILE_FRAMES][PHASE_MAX];
+} profile_ring = { .capacity = PROFILE_FRAMES, .phases = PHASE_MAX };
+
+// Time spent in the column phases of the current frame by all threads, in
+// nanoseconds.
+static int64_t profile_columns[PHASE_MAX];
+
+static const char* const phase_names[PHASE_MAX] = {
+    [PHASE_INPUT] = "input",
+    [PHASE_COLLISION] = "collision",
+    [PHASE_NETWORK] = "network",
+    [PHASE_UPDATE] = "update",
+    [PHASE_PARTICLES] = "particles",
+    [PHASE_BIN] = "sprite bins",
+    [PHASE_ROWS] = "floor & sky",
+    [PHASE_COLUMNS] = "columns",
+    [PHASE_UI] = "interface",
+    [PHASE_TOTAL] = "total",
+    [PHASE_WALLS] = "walls",
+    [PHASE_SPRITES] = "sprites",
+    [PHASE_FOG] = "fog",
+    [PHASE_REPROJECT] = "reproject",
+};
+
+// Start timing the first phase.
+static void profile_start(Profile* profile)
+{
+    if (profiling)
+        profile->start = get_time();
+}
+
+// End a phase, and start timing the next one.
+static void profile_mark(Profile* profile, int phase)
+{
+    if (profiling) {
+        const double now = get_time();
+        profile->phases[phase] += now - profile->start;
+        profile->start = now;
+    }
+}
+
+// Add the times of a thread's share of the column pass to the frame.
+static void profile_merge(const Profile* profile)
+{
+    if (!profiling)
+        return;
+    for (int i = PHASE_TOTAL + 1; i < PHASE_MAX; i++)
+        __atomic_fetch_add(&profile_columns[i], (int64_t) (profile->phases[i] * 1e6), __ATOMIC_RELAXED);
+}
+
+// Set up the rays for a packet of up to PACKET_SIZE columns of the 3D view,
+// starting at frame x position x0 and spaced `stride` columns apart.
+static void setup_packet(Column cols[PACKET_SIZE], int x0, int stride, int count)
+{
+    for (int i = 0; i < count; i++) {
+        Column* col = &cols[i];
+        col->x = x0 + i * stride;
+        float t = (float) col->x / (frame_w - 1) * 2.0f - 1.0f;
+        col->color = &column_color[col->x * frame_h];
+        col->light = &column_light[col->x * frame_h];
+        col->depth = &column_depth[col->x * frame_h];
+        col->px = view_x;
+        col->py = view_y;
+        col->vx = view_dx;
+        col->vy = view_dy;
+        col->dx = col->vx - col->vy * view_fov * t;
+        col->dy = col->vy + col->vx * view_fov * t;
+    }
+}
+
+// Render a packet of columns whose rays have been set up. The floor and sky
+// have already been drawn by the row pass. If `record` is set, the columns are
+// also saved for reprojection in the next frame.
+static void draw_packet(Column cols[PACKET_SIZE], int count, bool record, Profile* profile)
+{
+    // Find all wall hits before shading.
+    draw_walls(cols, count);
+    profile_mark(profile, PHASE_WALLS);
+
+    // Draw all objects, and write out the pixels for each column.
+    for (int i = 0; i < count; i++) {
+        Column* col = &cols[i];
+        const bool sprites = draw_sprites(col);
+        profile_mark(profile, PHASE_SPRITES);
+        shade_column(col, &frame[col->x]);
+        if (record) {
+            for (int y = 0; y < frame_h; y++)
+                history_color[col->x * frame_h + y] = frame[col->x + y * frame_w];
+            history_frame[col->x] = frame_count;
+            history_wall[col->x] = col->wall;
+            history_sprites[col->x] = sprites;
+        }
+        profile_mark(profile, PHASE_FOG);
+    }
+}
+
+// Try to fill in a column by reprojecting the previous frame, given the depth
+// of the column's wall in this frame. The column that looked in the same
+// direction in the previous frame is found, and its wall is projected into
+// this frame; if it doesn't land on this column at the depth found by the
+// raycast, the previous frame saw something else and the column must be shaded
+// from scratch. Returns whether the column was filled in.
+static bool reproject_column(const Column* col, float depth)
+{
+    // Find the column of the previous frame with the same ray direction. Only
+    // columns that are not being shaded in this frame (by other threads) can be
+    // used.
+    const float dot = col->dx * prev_view_dx + col->dy * prev_view_dy;
+    const float cross = col->dy * prev_view_dx - col->dx * prev_view_dy;
+    if (dot < 1e-3f)
+        return false;
+    const float prev_x = (cross / dot / view_fov + 1.0f) * (frame_w - 1) * 0.5f;
+    const int parity = col->x & 1;
+    const int x = floor((prev_x - parity) * 0.5f + 0.5f) * 2 + parity;
+    if (x < 0 || x >= frame_w || history_frame[x] != frame_count - 1 || history_sprites[x] || has_sprites(col->x, depth))
+        return false;
+
+    // Project the previous frame's wall hit into this frame.
+    const float t = (float) x / (frame_w - 1) * 2.0f - 1.0f;
+    const float prev_depth = history_wall[x];
+    const float hit_x = prev_view_x + prev_depth * (prev_view_dx - prev_view_dy * view_fov * t) - view_x;
+    const float hit_y = prev_view_y + prev_depth * (prev_view_dy + prev_view_dx * view_fov * t) - view_y;
+    const float hit_depth = hit_x * view_dx + hit_y * view_dy;
+    if (hit_depth < 1e-3f || abs(hit_depth - depth) > depth * 0.02f + 0.01f)
+        return false;
+    const float hit_t = (hit_y * view_dx - hit_x * view_dy) / hit_depth / view_fov;
+    if (abs((hit_t + 1.0f) * (frame_w - 1) * 0.5f - col->x) > 1.5f)
+        return false;
+
+    // Everything in a column lies in the same vertical plane, so the rows of
+    // the previous column are just scaled around the horizon. Rows that weren't
+    // visible in the previous frame can only be floor or sky, which the row pass
+    // has already drawn.
+    const float scale = hit_depth / prev_depth;
+    const float center = frame_h * 0.5f;
+    const uint32_t* prev = &history_color[x * frame_h];
+    for (int y = 0; y < frame_h; y++) {
+        const int prev_y = floor(center + (y + 0.5f - center) * scale);
+        frame[col->x + y * frame_w] = prev_y >= 0 && prev_y < frame_h ? prev[prev_y] :
+            apply_fog(col->color[y], col->light[y], col->x, y);
+    }
+    return true;
+}
+
+// Render a packet of columns that weren't shaded in the previous frame, by
+// reprojecting the previous frame where possible. The remaining columns are
+// shaded normally, but aren't recorded, because other threads may be reading
+// the previous frame's copy of them.
+static void reproject_packet(Column cols[PACKET_SIZE], int count, Profile* profile)
+{
+    float dx[PACKET_SIZE] = {0};
+    float dy[PACKET_SIZE] = {0};
+    float t[PACKET_SIZE] = {0};
+    float depth[PACKET_SIZE];
+    for (int i = 0; i < count; i++) {
+        dx[i] = cols[i].dx;
+        dy[i] = cols[i].dy;
+    }
+    raycast_packet(cols[0].px, cols[0].py, dx, dy, t, depth);
+    int missed = 0;
+    for (int i = 0; i < count; i++)
+        if (!reproject_column(&cols[i], depth[i]))
+            cols[missed++] = cols[i];
+    profile_mark(profile, PHASE_REPROJECT);
+    if (missed)
+        draw_packet(cols, missed, false, profile);
+}
+
+// Render the columns of the 3D view from x0 up to x1. In an interlaced frame,
+// the columns with the same parity as the frame count are shaded, and the
+// others are reprojected. Packets take every other column in that case, so x0
+// must be even.
+static void draw_column_range(int x0, int x1)
+{
+    Column cols[PACKET_SIZE];
+    Profile profile = { 0 };
+    profile_start(&profile);
+    if (!frame_interlaced) {
+        for (int x = x0; x < x1; x += PACKET_SIZE) {
+            setup_packet(cols, x, 1, min(PACKET_SIZE, x1 - x));
+            draw_packet(cols, min(PACKET_SIZE, x1 - x), true, &profile);
+        }
+        profile_merge(&profile);
+        return;
+    }
+    const int parity = frame_count & 1;
+    for (int x = x0 + parity; x < x1; x += 2 * PACKET_SIZE) {
+        setup_packet(cols, x, 2, min(PACKET_SIZE, (x1 - x + 1) / 2));
+        draw_packet(cols, min(PACKET_SIZE, (x1 - x + 1) / 2), true, &profile);
+    }
+    for (int x = x0 + !parity; x < x1; x += 2 * PACKET_SIZE) {
+        setup_packet(cols, x, 2, min(PACKET_SIZE, (x1 - x + 1) / 2));
+        reproject_packet(cols, min(PACKET_SIZE, (x1 - x + 1) / 2), &profile);
+    }
+    profile_merge(&profile);
+}
+
+// Decide whether to interlace the next frame. Frames are drawn in full when
+// the camera has jumped (reprojecting would only produce misses), and for the
+// ghost, who sees through walls.
+static void begin_frame(void)
+{
+    const float dx = view_x - prev_view_x;
+    const float dy = view_y - prev_view_y;
+    frame_count++;
+    frame_interlaced = interlaced && frame_count > 1 && player_self != player_ghost && dx * dx + dy * dy < 0.25f;
+}
+
+// Remember the camera of a finished frame.
+static void end_frame(void)
+{
+    prev_view_x = view_x;
+    prev_view_y = view_y;
+    prev_view_dx = view_dx;
+    prev_view_dy = view_dy;
+    prev_view_ghost = player_self == player_ghost;
+}
+
+// Turn interlaced rendering on or off.
+__attribute__((export_name("setInterlaced")))
+void set_interlaced(bool enabled)
+{
+    interlaced = enabled;
+}
+
+#ifdef WEB3D_THREADS
+
+// Threaded rendering. Worker threads share the module's memory and wait in
+// `thread_main()` until the main thread starts a new frame; then every thread
+// (including the main thread) claims batches of rows for the floor and sky
+// until none are left, waits for all rows to finish, and then does the same
+// for columns. Each row and column only depends on state that is fixed for
+// the whole frame, so the result is the same no matter how many workers take
+// part.
+#define MAX_THREADS 8
+#define THREAD_STACK_SIZE (1 << 16)
+#define ROW_BATCH ROW_TILE
+#define COLUMN_BATCH (2 * PACKET_SIZE)
+
+static int frame_generation; // Incremented to wake up the workers.
+static int row_next;         // Generation and index of the next unclaimed row.
+static int row_done;         // Number of finished rows.
+static int column_next;      // Generation and index of the next unclaimed column.
+static int column_done;      // Number of finished columns.
+
+// Claim a batch of items from a counter holding the frame generation in its
+// upper 16 bits and the next unclaimed index in its lower 16 bits. Returns -1
+// once every item has been claimed, or when the counter has already moved on
+// to a newer frame (so a worker that wakes up late can't join the wrong one).
+static int claim_batch(int* next, int generation, int batch, int count)
+{
+    int value = __atomic_load_n(next, __ATOMIC_SEQ_CST);
+    for (;;) {
+        int index = value & 0xffff;
+        if ((value >> 16) != (generation & 0x7fff) || index >= count)
+            return -1;
+        if (__atomic_compare_exchange_n(next, &value, value + batch, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            return index;
+    }
+}
+
+// Draw rows until all of them have been claimed, then wait for the others.
+static void draw_rows(int generation)
+{
+    for (;;) {
+        int y0 = claim_batch(&row_next, generation, ROW_BATCH, frame_h);
+        if (y0 < 0)
+            break;
+        int y1 = min(y0 + ROW_BATCH, frame_h);
+        draw_rows_range(y0, y1);
+        __atomic_fetch_add(&row_done, y1 - y0, __ATOMIC_SEQ_CST);
+    }
+    while (__atomic_load_n(&row_done, __ATOMIC_SEQ_CST) < frame_h &&
+           __atomic_load_n(&frame_generation, __ATOMIC_SEQ_CST) == generation);
+}
+
+// Draw columns until all of them have been claimed.
+static void draw_columns(int generation)
+{
+    for (;;) {
+        int x0 = claim_batch(&column_next, generation, COLUMN_BATCH, frame_w);
+        if (x0 < 0)
+            return;
+        int x1 = min(x0 + COLUMN_BATCH, frame_w);
+        draw_column_range(x0, x1);
+        __atomic_fetch_add(&column_done, x1 - x0, __ATOMIC_SEQ_CST);
+    }
+}
+
+// Get the top of the stack for a worker thread. The worker must set its
+// `__stack_pointer` to this address before calling `thread_main()`.
+__attribute__((export_name("threadStack")))
+void* thread_stack(int index)
+{
+    static _Alignas(16) uint8_t stacks[MAX_THREADS][THREAD_STACK_SIZE];
+    return index >= 0 && index < MAX_THREADS ? stacks[index + 1] : NULL;
+}
+
+// Entry point for worker threads. Never returns.
+__attribute__((export_name("threadMain")))
+void thread_main(void)
+{
+    int generation = __atomic_load_n(&frame_generation, __ATOMIC_SEQ_CST);
+    for (;;) {
+        __builtin_wasm_memory_atomic_wait32(&frame_generation, generation, -1);
+        int next = __atomic_load_n(&frame_generation, __ATOMIC_SEQ_CST);
+        if (next != generation) {
+            generation = next;
+            draw_rows(generation);
+            draw_columns(generation);
+        }
+    }
+}
+
+// Render the 3D view using every available thread. The main thread isn't
+// allowed to block, so it spins at the barriers instead.
+static void draw_view(Profile* profile)
+{
+    begin_frame();
+    int generation = __atomic_load_n(&frame_generation, __ATOMIC_SEQ_CST) + 1;
+    __atomic_store_n(&row_done, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&row_next, (generation & 0x7fff) << 16, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&column_done, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&column_next, (generation & 0x7fff) << 16, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&frame_generation, generation, __ATOMIC_SEQ_CST);
+    __builtin_wasm_memory_atomic_notify(&frame_generation, -1);
+    draw_rows(generation);
+    profile_mark(profile, PHASE_ROWS);
+    draw_columns(generation);
+    while (__atomic_load_n(&column_done, __ATOMIC_SEQ_CST) < frame_w);
+    profile_mark(profile, PHASE_COLUMNS);
+    end_frame();
+}
+
+#else
+
+// Render the 3D view: first the floor and sky one row at a time, then walls
+// and sprites one packet of vertical slices at a time.
+static void draw_view(Profile* profile)
+{
+    begin_frame();
+    draw_rows_range(0, frame_h);
+    profile_mark(profile, PHASE_ROWS);
+    draw_column_range(0, frame_w);
+    profile_mark(profile, PHASE_COLUMNS);
+    end_frame();
+}
+
+#endif
+
+// Reallocate the frame buffer and the buffers that depend on it for a new
+// resolution, and set up the projection to match.
+static void resize_frame(int w, int h)
+{
+    // Every buffer is allocated again from an empty arena, big enough for the
+    // largest possible frame.
+    static _Alignas(16) char buffer[
+        MAX_FRAME_W * MAX_FRAME_H * (sizeof(*frame) + sizeof(*view_copy) + sizeof(*column_color) + sizeof(*column_light) + sizeof(*column_depth) + sizeof(*history_color)) +
+        MAX_FRAME_W * (SPRITE_WORDS * sizeof(*sprite_bins) + sizeof(*history_frame) + sizeof(*history_wall) + sizeof(*history_sprites)) +
+        MAX_FRAME_H * sizeof(*row_distance) + 256];
+    Arena arena = { .buffer = buffer };
+    frame = arena_alloc(&arena, w * h * sizeof(*frame));
+    view_copy = arena_alloc(&arena, w * h * sizeof(*view_copy));
+    view_copy_valid = false;
+    column_color = arena_alloc(&arena, w * h * sizeof(*column_color));
+    column_light = arena_alloc(&arena, w * h * sizeof(*column_light));
+    column_depth = arena_alloc(&arena, w * h * sizeof(*column_depth));
+    row_distance = arena_alloc(&arena, h * sizeof(*row_distance));
+    sprite_bins = arena_alloc(&arena, w * SPRITE_WORDS * sizeof(*sprite_bins));
+    history_color = arena_alloc(&arena, w * h * sizeof(*history_color));
+    history_frame = arena_alloc(&arena, w * sizeof(*history_frame));
+    history_wall = arena_alloc(&arena, w * sizeof(*history_wall));
+    history_sprites = arena_alloc(&arena, w * sizeof(*history_sprites));
+    memset(history_frame, 0, w * sizeof(*history_frame));
+
+    // Scale the projection with the height of the frame, and widen or narrow
+    // the field of view to keep pixels square.
+    frame_w = w;
+    frame_h = h;
+    frame_scale = (float) h / FRAME_H;
+    view_fov = FOV * (w - 1) / ((FRAME_W - 1) * frame_scale);
+    wall_height = WALL_HEIGHT * frame_scale;
+
+    // Precompute the distance to the sky (top half) or floor (bottom half)
+    // for each row of the frame. The floor at the horizon is infinitely far
+    // away, so distances are capped where the fog has long hidden everything.
+    for (int y = 0; y < frame_h; y++)
+        row_distance[y] = min(ROW_DISTANCE_MAX, y < frame_h / 2 ? -500 * frame_scale / (y - frame_h * 0.5) :
+            wall_height / max(y - frame_h * 0.5f, wall_height / ROW_DISTANCE_MAX));
+}
+
+// Adaptive resolution. When a frame budget is set, `draw()` measures how long
+// it takes over a window of frames, and moves between levels of resolution
+// (from half to all of the resolution set by `set_resolution()`) to stay
+// within the budget.
+#define ADAPTIVE_WINDOW 30
+#define ADAPTIVE_LEVELS 8
+#define ADAPTIVE_LEVEL_MIN (ADAPTIVE_LEVELS / 2)
+
+static int resolution_w = FRAME_W;           // Resolution set by `set_resolution()`.
+static int resolution_h = FRAME_H;
+static double frame_budget;                  // Target time for `draw()`, in milliseconds.
+static int adaptive_level = ADAPTIVE_LEVELS; // Current level (ADAPTIVE_LEVEL_MIN to ADAPTIVE_LEVELS).
+static int adaptive_frames;                  // Number of frames measured at this level.
+static double adaptive_time;                 // Total time of those frames.
+
+// Resize the frame for an adaptive resolution level.
+static void set_adaptive_level(int level)
+{
+    adaptive_level = level;
+    adaptive_frames = 0;
+    adaptive_time = 0.0;
+    const int w = max(MIN_FRAME_W, resolution_w * level / ADAPTIVE_LEVELS);
+    const int h = max(MIN_FRAME_H, resolution_h * level / ADAPTIVE_LEVELS);
+    if (w != frame_w || h != frame_h)
+        resize_frame(w, h);
+}
+
+// Record the time taken by a frame, and change the resolution if the average
+// over the last window is over budget, or far enough under budget that the
+// next level up should still fit (assuming the cost scales with the number of
+// pixels).
+static void adapt_resolution(double time)
+{
+    if (frame_budget <= 0.0)
+        return;
+    adaptive_time += time;
+    if (++adaptive_frames < ADAPTIVE_WINDOW)
+        return;
+    const double average = adaptive_time / adaptive_frames;
+    const double growth = (double) (adaptive_level + 1) * (adaptive_level + 1) / (adaptive_level * adaptive_level);
+    if (average > frame_budget && adaptive_level > ADAPTIVE_LEVEL_MIN)
+        set_adaptive_level(adaptive_level - 1);
+    else if (average * growth < frame_budget * 0.8 && adaptive_level < ADAPTIVE_LEVELS)
+        set_adaptive_level(adaptive_level + 1);
+    else
+        set_adaptive_level(adaptive_level);
+}
+
+// Set the resolution of the frame buffer (clamped to the supported range). With
+// adaptive resolution, this is the highest resolution that will be used.
+__attribute__((export_name("setResolution")))
+void set_resolution(int w, int h)
+{
+    resolution_w = max(MIN_FRAME_W, min(w, MAX_FRAME_W));
+    resolution_h = max(MIN_FRAME_H, min(h, MAX_FRAME_H));
+    set_adaptive_level(ADAPTIVE_LEVELS);
+}
+
+// Set the time budget for drawing a frame in milliseconds, and turn on adaptive
+// resolution. A budget of zero turns it off again.
+__attribute__((export_name("setFrameBudget")))
+void set_frame_budget(double milliseconds)
+{
+    frame_budget = milliseconds;
+    set_adaptive_level(ADAPTIVE_LEVELS);
+}
+
+// Get the dimensions of the frame returned by `draw()`.
+__attribute__((export_name("frameWidth")))
+int frame_width(void)
+{
+    return frame_w;
+}
+
+__attribute__((export_name("frameHeight")))
+int frame_height(void)
+{
+    return frame_h;
+}
+
+// Undo the previous frame's user interface, by copying the kept 3D view back
+// over it.
+static void restore_view(void)
+{
+    for (int i = 0; i < ui_rect_count; i++) {
+        const Rect* rect = &ui_rects[i];
+        for (int y = rect->y; y < rect->y + rect->h; y++)
+            memcpy(&frame[rect->x + y * frame_w], &view_copy[rect->x + y * frame_w], rect->w * sizeof(*frame));
+    }
+}
+
+// Keep a copy of a freshly drawn 3D view if it can be reused, which is when
+// there are no sprites in it.
+static void keep_view(void)
+{
+    view_copy_valid = !sprite_count;
+    if (view_copy_valid)
+        memcpy(view_copy, frame, frame_w * frame_h * sizeof(*frame));
+}
+
+// Work out which regions of the frame buffer changed in this frame.
+static void update_dirty_rects(bool reused_view)
+{
+    if (!reused_view) {
+        dirty.count = 1;
+        dirty.rects[0] = (Rect) { 0, 0, frame_w, frame_h };
+        return;
+    }
+    dirty.count = 0;
+    for (int i = 0; i < prev_ui_rect_count; i++)
+        dirty.rects[dirty.count++] = prev_ui_rects[i];
+    for (int i = 0; i < ui_rect_count; i++)
+        dirty.rects[dirty.count++] = ui_rects[i];
+}
+
+// Get the list of regions of the frame buffer that changed in the last frame,
+// for presenting only those. It starts with a 32-bit count, followed by a
+// rectangle for each region: four 32-bit integers for its position and size.
+__attribute__((export_name("dirtyRects")))
+void* dirty_rects(void)
+{
+    return &dirty;
+}
+
+// Turn profiling on or off, without showing the overlay.
+__attribute__((export_name("setProfiling")))
+void set_profiling(bool enabled)
+{
+    profile_enabled = enabled;
+}
+
+// Get the ring buffer of frame timings, for reading from JavaScript. It starts
+// with three 32-bit integers: the number of frames it holds, the number of
+// phases per frame, and the number of frames profiled so far. Those are
+// followed by the timings, one 32-bit float per phase of each frame.
+__attribute__((export_name("profileBuffer")))
+void* profile_buffer(void)
+{
+    return &profile_ring;
+}
+
+// Get the name of a phase in the ring buffer (or NULL if there's no such
+// phase), as a null-terminated string.
+__attribute__((export_name("profilePhaseName")))
+const char* profile_phase_name(int phase)
+{
+    return phase >= 0 && phase < PHASE_MAX ? phase_names[phase] : NULL;
+}
+
+// Store the timings of a finished frame in the ring buffer.
+static void profile_record(Profile* profile)
+{
+    if (!profiling)
+        return;
+    float* times = profile_ring.times[profile_ring.frames++ % PROFILE_FRAMES];
+    for (int i = 0; i < PHASE_MAX; i++) {
+        if (i < PHASE_TOTAL)
+            profile->phases[PHASE_TOTAL] += profile->phases[i];
+        else if (i > PHASE_TOTAL)
+            profile->phases[i] = profile_columns[i] * 1e-6;
+        times[i] = profile->phases[i];
+    }
+    memset(profile_columns, 0, sizeof(profile_columns));
+}
+
+// Convert a time in milliseconds to a string with two decimals.
+static void string_from_ms(char* buffer, float time)
+{
+    const unsigned int hundredths = time * 100.0f + 0.5f;
+    buffer = string_from_int(buffer, hundredths / 100);
+    buffer[0] = '.';
+    buffer[1] = '0' + hundredths / 10 % 10;
+    buffer[2] = '0' + hundredths % 10;
+    buffer[3] = '\0';
+}
+
+// Draw the average and 99th percentile time of each phase over the frames in
+// the ring buffer, in milliseconds, on a darkened box in the top left corner,
+// followed by the round trip time to the server.
+static void draw_profile_overlay(void)
+{
+    const int count = profile_ring.frames < PROFILE_FRAMES ? profile_ring.frames : PROFILE_FRAMES;
+    const int x0 = 4, y0 = 4, w = 124, h = (PHASE_MAX + 2) * 8 + 4, line = 8;
+    add_ui_rect(x0, y0, x0 + w, y0 + h);
+    for (int y = y0; y < min(y0 + h, frame_h); y++)
+    for (int x = x0; x < min(x0 + w, frame_w); x++)
+        frame[x + y * frame_w] = (frame[x + y * frame_w] >> 2 & 0x3f3f3f) | 0xff000000;
+    font_draw(&font_tiny, x0 + 2, y0 + 2, 0xff80ffff, "phase");
+    font_draw(&font_tiny, x0 + w - 36 - font_width(&font_tiny, "avg"), y0 + 2, 0xff80ffff, "avg");
+    font_draw(&font_tiny, x0 + w - 2 - font_width(&font_tiny, "p99"), y0 + 2, 0xff80ffff, "p99");
+    for (int phase = 0; phase < PHASE_MAX && count; phase++) {
+        // Sort this phase's times to find the percentile.
+        float sorted[PROFILE_FRAMES];
+        float sum = 0.0f;
+        for (int i = 0; i < count; i++) {
+            const float time = profile_ring.times[i][phase];
+            int j = i;
+            for (; j > 0 && sorted[j - 1] > time; j--)
+                sorted[j] = sorted[j - 1];
+            sorted[j] = time;
+            sum += time;
+        }
+        char average[16], p99[16];
+        string_from_ms(average, sum / count);
+        string_from_ms(p99, sorted[(count - 1) * 99 / 100]);
+        const int y = y0 + 2 + (phase + 1) * line;
+        const uint32_t color = phase == PHASE_TOTAL ? 0xff80ffff : 0xffffffff;
+        font_draw(&font_tiny, x0 + 2 + (phase > PHASE_TOTAL) * 6, y, color, phase_names[phase]);
+        font_draw(&font_tiny, x0 + w - 36 - font_width(&font_tiny, average), y, color, average);
+        font_draw(&font_tiny, x0 + w - 2 - font_width(&font_tiny, p99), y, color, p99);
+    }
+    char round_trip[16];
+    string_from_ms(round_trip, clock_sync.round_trip);
+    const int y = y0 + 2 + (PHASE_MAX + 1) * line;
+    font_draw(&font_tiny, x0 + 2, y, 0xff80ffff, "round trip");
+    font_draw(&font_tiny, x0 + w - 2 - font_width(&font_tiny, round_trip), y, 0xff80ffff, round_trip);
 }
 
 // Render the next frame of the game.
 __attribute__((export_name("draw")))
 void* draw(__externref_t socket, double timestamp, double date_now, bool logged_in)
 {
+    // Pick the resolution based on how long previous frames took. This has to
+    // happen before drawing, since resizing reuses the memory of the frame.
+    // Frames that reused the view don't count, since they cost next to nothing
+    // (and resizing would stop the view from being reused anyway).
+    static double prev_cost; // Zero if the previous frame reused the view.
+    if (prev_cost > 0.0)
+        adapt_resolution(prev_cost);
+    const double start = get_time();
+    Profile profile = { 0 };
+    profiling = profile_enabled || profile_overlay;
+    profile_start(&profile);
+
+    // Record the current timestamp, and handle the messages that arrived
+    // since the last frame. Match times are in server time.
+    time_now = date_now;
+    recv_messages();
+    time_server = time_now + time_server_offset;
+    profile_mark(&profile, PHASE_NETWORK);
+
     // Measure time delta since the previous frame.
     static double prev_timestamp;
     time_delta = min(0.1, (timestamp - prev_timestamp) / 1000.0);
@@ -1089,9 +2589,6 @@ void* draw(__externref_t socket, double timestamp, double date_now, bool logged_
         time_start = timestamp;
     time_elapsed = (timestamp - time_start) / 1000.0;
 
-    // Record the current timestamp.
-    time_now = date_now;
-
     // Handle player movement.
     const float rotate_speed = logged_in * time_delta * PLAYER_TURN_SPEED;
     const float run_speed = logged_in * time_delta * PLAYER_RUN_SPEED;
@@ -1104,6 +2601,7 @@ void* draw(__externref_t socket, double timestamp, double date_now, bool logged_
     player_angle += rotate_speed * (key_held[KEY_RIGHT] - key_held[KEY_LEFT]);
     player_x += run_speed * (run_f * cosf(player_angle) - run_s * sinf(player_angle));
     player_y += run_speed * (run_f * sinf(player_angle) + run_s * cosf(player_angle));
+    profile_mark(&profile, PHASE_INPUT);
 
     // Do collision detection against walls.
     if (player_self != player_ghost) {
@@ -1126,14 +2624,14 @@ void* draw(__externref_t socket, double timestamp, double date_now, bool logged_
     // Do collision detection against the bounds of the map.
     player_x = max(0.5f, min(player_x, MAP_W - 0.5f));
     player_y = max(0.5f, min(player_y, MAP_H - 0.5f));
+    profile_mark(&profile, PHASE_COLLISION);
 
-    // Send the player position.
-    float player_dx = cosf(player_angle);
-    float player_dy = sinf(player_angle);
-    send_move(socket, player_x, player_y, player_dx, player_dy);
+    // Send the player position, and sync the clock.
+    send_move(socket, player_x, player_y, player_angle);
+    send_ping(socket);
 
     // Collect gems when touching them.
-    if (player_self != player_ghost && time_now >= time_match) {
+    if (player_self != player_ghost && time_server >= time_match + COLLECT_DELAY) {
         for (int i = 0; i < MAX_GEMS; i++) {
             if (gem_mask & (1ull << i)) {
                 Gem* gem = &gem_array[i];
@@ -1144,61 +2642,54 @@ void* draw(__externref_t socket, double timestamp, double date_now, bool logged_
             }
         }
     }
+    profile_mark(&profile, PHASE_NETWORK);
 
     // Smooth out player movement.
     player_angle_smooth = smooth(player_angle_smooth, player_angle, 20.0f * time_delta);
     player_x_smooth = smooth(player_x_smooth, player_x, 10.0f * time_delta);
     player_y_smooth = smooth(player_y_smooth, player_y, 10.0f * time_delta);
 
-    // Update particle effects.
+    // Update the other players, then particle effects.
+    update_players();
+    profile_mark(&profile, PHASE_UPDATE);
     update_particles(time_delta);
-    update_players(time_delta);
-
-    // Interpolate player positions.
-    for (int i = 0; i < MAX_PLAYERS; i++) {
-        Player* player = &players[i];
-        if (!player->id || player->id == player_self)
-            continue;
-        player->vx = smooth(player->vx, player->x, 10.0f * time_delta);
-        player->vy = smooth(player->vy, player->y, 10.0f * time_delta);
-    }
+    profile_mark(&profile, PHASE_PARTICLES);
 
     // Set up state for raycasting.
-    Column col = {
-        .px = player_x_smooth,
-        .py = player_y_smooth,
-        .vx = cosf(player_angle_smooth),
-        .vy = sinf(player_angle_smooth),
-    };
-
-    // Render the frame one vertical slice at a time.
-    for (int x = 0; x < FRAME_W; x++) {
-
-        // Determine the direction vector for the ray.
-        float t = (float) x / (FRAME_W - 1) * 2.0f - 1.0f;
-        col.x = x;
-        col.dx = col.vx - col.vy * FOV * t;
-        col.dy = col.vy + col.vx * FOV * t;
-
-        // Draw all objects.
-        draw_sky(&col);
-        draw_floor(&col);
-        draw_walls(&col);
-        draw_gems(&col);
-        draw_particles(&col);
-        draw_players(&col);
-
-        // Write out the pixels for this column.
-        for (int y = 0; y < FRAME_H; y++)
-            frame[x + y * FRAME_W] = apply_fog(col.color[y], col.light[y], x, y);
+    view_x = player_x_smooth;
+    view_y = player_y_smooth;
+    view_dx = cosf(player_angle_smooth);
+    view_dy = sinf(player_angle_smooth);
+    bin_sprites();
+    profile_mark(&profile, PHASE_BIN);
+
+    // Render the 3D view, then wait for all columns to finish before drawing
+    // the user interface on top. If nothing in view can have changed since
+    // the last view was kept, only the user interface needs to be redrawn.
+    const bool reuse_view = view_copy_valid && !sprite_count && (player_self == player_ghost) == prev_view_ghost &&
+        view_x == prev_view_x && view_y == prev_view_y && view_dx == prev_view_dx && view_dy == prev_view_dy;
+    if (reuse_view) {
+        restore_view();
+    } else {
+        draw_view(&profile);
+        keep_view();
     }
 
+    prev_ui_rect_count = ui_rect_count;
+    memcpy(prev_ui_rects, ui_rects, sizeof(ui_rects));
+    ui_rect_count = 0;
     draw_user_interface(logged_in);
+    profile_mark(&profile, PHASE_UI);
+    profile_record(&profile);
+    if (profile_overlay)
+        draw_profile_overlay();
+    update_dirty_rects(reuse_view);
 
     // Reset keyboard state.
     memset(key_down, 0, sizeof(key_down));
     memset(key_up, 0, sizeof(key_up));
 
     // Return the finished frame so that it can be presented to the canvas.
+    prev_cost = reuse_view ? 0.0 : get_time() - start;
     return frame;
 }
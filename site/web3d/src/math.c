@@ -1,5 +1,10 @@
 #include "web3d.h"
 
+// The helpers that the fog code in main.c uses (min, max, fract, dither and
+// lerp) are compiled without fast-math optimizations like the fog code itself,
+// since LTO inlines them into it.
+#pragma float_control(precise, on, push)
+
 // Get the smaller of two numbers.
 float min(float x, float y)
 {
@@ -18,6 +23,8 @@ float fract(float x)
     return x - floor(x);
 }
 
+#pragma float_control(pop)
+
 // Fast approximation of the sine function.
 float sinf(float x)
 {
@@ -49,6 +56,8 @@ float smooth(float source, float target, float rate)
     return (target + (source - target) * exp2f(-rate));
 }
 
+#pragma float_control(precise, on, push)
+
 // Dithering function (pattern used: Interleaved Gradient Noise).
 float dither(int x, int y)
 {
@@ -61,6 +70,8 @@ float lerp(float x0, float x1, float t)
     return (1.0f - t) * x0 + t * x1;
 }
 
+#pragma float_control(pop)
+
 // Return -1 if a number is negative, 1 if it's positive, and 0 if it's zero.
 float sign(float x)
 {
@@ -0,0 +1,125 @@
+#include "web3d.h"
+
+// Encoding of the messages exchanged with the game server (protocol.ts has the
+// same functions). Every message starts with a type byte. Player IDs, scores
+// and gem indices are LEB128 varints (zigzag encoded when they can be
+// negative), positions are 16-bit fixed point fractions of the map size,
+// headings are 8-bit fractions of a turn, and timestamps are doubles.
+// Everything is little-endian.
+
+// Read a byte. Reading past the end of the message yields zeros and sets the
+// error flag, so that a message only needs to be checked once it's been read.
+uint8_t read_u8(Reader* reader)
+{
+    if (reader->offset >= reader->size) {
+        reader->error = true;
+        return 0;
+    }
+    return reader->data[reader->offset++];
+}
+
+// Read a 16-bit integer.
+uint16_t read_u16(Reader* reader)
+{
+    const uint16_t low = read_u8(reader);
+    return low | read_u8(reader) << 8;
+}
+
+// Read an unsigned varint: 7 bits per byte, low bits first, with the high bit
+// set on every byte but the last.
+uint64_t read_varint(Reader* reader)
+{
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        const uint8_t byte = read_u8(reader);
+        value |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return value;
+    }
+    reader->error = true;
+    return 0;
+}
+
+// Read a zigzag encoded varint (0, -1, 1, -2, ... are stored as 0, 1, 2, 3...).
+int64_t read_zigzag(Reader* reader)
+{
+    const uint64_t value = read_varint(reader);
+    return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+// Read a double.
+double read_f64(Reader* reader)
+{
+    uint64_t bits = 0;
+    for (int shift = 0; shift < 64; shift += 8)
+        bits |= (uint64_t) read_u8(reader) << shift;
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Write a byte. Bytes that don't fit the buffer are dropped, and set the error
+// flag.
+void write_u8(Writer* writer, uint8_t value)
+{
+    if (writer->size >= writer->capacity) {
+        writer->error = true;
+        return;
+    }
+    writer->data[writer->size++] = value;
+}
+
+// Write a 16-bit integer.
+void write_u16(Writer* writer, uint16_t value)
+{
+    write_u8(writer, value);
+    write_u8(writer, value >> 8);
+}
+
+// Write an unsigned varint.
+void write_varint(Writer* writer, uint64_t value)
+{
+    for (; value >= 0x80; value >>= 7)
+        write_u8(writer, value | 0x80);
+    write_u8(writer, value);
+}
+
+// Write a zigzag encoded varint.
+void write_zigzag(Writer* writer, int64_t value)
+{
+    write_varint(writer, (uint64_t) value << 1 ^ (uint64_t) (value >> 63));
+}
+
+// Write a double.
+void write_f64(Writer* writer, double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    for (int shift = 0; shift < 64; shift += 8)
+        write_u8(writer, bits >> shift);
+}
+
+// Quantize a coordinate in the range [0, size] to 16 bits.
+uint16_t quantize_position(float x, float size)
+{
+    const float q = floor(x / size * 65535.0f + 0.5f);
+    return q < 0.0f ? 0 : q > 65535.0f ? 65535 : (uint16_t) q;
+}
+
+// Get the coordinate that a quantized coordinate stands for.
+float dequantize_position(uint16_t q, float size)
+{
+    return q * (size / 65535.0f);
+}
+
+// Quantize an angle in radians to 8 bits, wrapping it around to [0, TAU).
+uint8_t quantize_angle(float angle)
+{
+    return (int) floor(fract(angle * (1.0f / TAU)) * 256.0f + 0.5f) & 0xff;
+}
+
+// Get the angle in radians that a quantized angle stands for.
+float dequantize_angle(uint8_t q)
+{
+    return q * (TAU / 256.0f);
+}
@@ -11,8 +11,16 @@ typedef __UINT32_TYPE__ uint32_t;
 typedef __UINT64_TYPE__ uint64_t;
 typedef __SIZE_TYPE__ size_t;
 
+// JavaScript references only exist in WebAssembly. Host builds (for the
+// benchmarks in `tools/bench.c`) use plain pointers instead.
+#ifndef __wasm__
+typedef void* __externref_t;
+#endif
+
 // Yeah, I need to define these myself.
+#ifndef NULL
 #define NULL ((void*) 0)
+#endif
 #define INT_MAX 0x7fffffff
 
 // Two times pi.
@@ -25,6 +33,7 @@ typedef __SIZE_TYPE__ size_t;
 #define abs(...) __builtin_fabsf(__VA_ARGS__)
 #define floor(...) __builtin_floorf(__VA_ARGS__)
 #define memset(...) __builtin_memset(__VA_ARGS__)
+#define memcpy(...) __builtin_memcpy(__VA_ARGS__)
 
 // Dimensions of the tile map.
 #define MAP_W 25
@@ -32,10 +41,73 @@ typedef __SIZE_TYPE__ size_t;
 #define MAP_SIZE (MAP_W * MAP_H)
 #define MAP_ROOMS 20
 
+// Layout of font images.
+#define FONT_GLYPH_MIN ' '
+#define FONT_GLYPH_MAX '~'
+#define FONT_GLYPH_COUNT (FONT_GLYPH_MAX - FONT_GLYPH_MIN + 1)
+#define FONT_GLYPHS_PER_ROW 16
+#define FONT_GLYPHS_PER_COL 6
+
+// Number of gem sprites in the gem atlas.
+#define GEM_TYPES 14
+
+// Textures. Texels are 8-bit indices into a palette, and are stored column by
+// column, since walls and sprites are drawn in vertical slices. Columns are
+// padded to a power of two, and tiling textures (floor, walls) have power of
+// two dimensions, so that wrapping around is just a mask. Each texture has a
+// chain of mipmaps, where every level is half the size of the one before.
+#define TEXTURE_LEVELS 5
+typedef struct {
+    uint16_t w, h;           // Size of the texture (at level 0).
+    uint8_t shift;           // Log2 of the texels per column (at level 0).
+    uint8_t levels;          // Number of mipmap levels.
+    uint32_t color;          // Average color (used for particle effects).
+    const uint32_t* palette; // RGBA color of each texel index (0 if transparent).
+    void* data;              // GIF file data (before load) or texel data (after load).
+    uint32_t size;           // Size of the GIF file data (before load).
+    const uint8_t* mips[TEXTURE_LEVELS]; // Texel data of each level (the first is `data`).
+} Texture;
+
+// Fonts.
+typedef struct {
+    uint16_t w, h;                      // Size of the font texture.
+    uint16_t width[FONT_GLYPH_COUNT];   // Per-glyph width.
+    void* data;                         // GIF or texel data (same as Texture).
+    uint32_t size;                      // Size of the GIF file data (before load).
+} Font;
+
+// Get the texels in column x of a mipmap level of a texture.
+static inline const uint8_t* texture_column(const Texture* tex, int level, size_t x)
+{
+    return tex->mips[level] + (x << (tex->shift - level));
+}
+
+// assets.c
+extern Texture texture_floor;
+extern Texture texture_wall;
+extern Texture texture_gems;
+extern Texture texture_barrier;
+extern Texture texture_ghost;
+extern Texture texture_guy_back;
+extern Texture texture_guy_front;
+extern Texture texture_guy_left;
+extern Texture texture_guy_right;
+extern Texture texture_gem[GEM_TYPES];
+extern Font font_tiny;
+extern Font font_big;
+void texture_load(Texture* tex);
+void texture_sub(Texture* tex, Texture* src, int x, int y, int w, int h);
+void font_load(Font* font);
+void assets_load(void);
+size_t assets_pack(uint8_t* blob, size_t capacity);
+void assets_unpack(const uint8_t* blob);
+
 // gif.c
 int gif_get_image_w(const uint8_t* gif);
 int gif_get_image_h(const uint8_t* gif);
-void* gif_get_pixels(const uint8_t* gif, void* pixels);
+int gif_get_frame_count(const uint8_t* gif, size_t size);
+int gif_get_indices(const uint8_t* gif, size_t size, uint8_t* indices, size_t indices_size, uint32_t palette[256]);
+int gif_get_pixels(const uint8_t* gif, size_t size, void* pixels, size_t pixels_size);
 
 // map.c
 bool map_inside(int x, int y);
@@ -64,3 +136,50 @@ float random_float(float min, float max);
 int random_hash(size_t index, size_t range);
 int random_hash_x(size_t index, size_t range);
 int random_hash_y(size_t index, size_t range);
+
+// protocol.c
+#define PROTOCOL_VERSION 3 // Sent by clients on login (should match protocol.ts).
+enum {                     // Message types (should match MessageType in protocol.ts).
+    MESSAGE_JOIN,          // varint id, varint score, name
+    MESSAGE_QUIT,          // varint id
+    MESSAGE_BEGIN,         // varint self, varint ghost, f64 timestamp, varint gems
+    MESSAGE_COUNT,         // f64 timestamp
+    MESSAGE_END,
+    MESSAGE_MOVE,          // u8 fields, then the fields present
+    MESSAGE_COLLECT,       // (varint id,) zigzag gem index (, varint score)
+    MESSAGE_SNAPSHOT = 8,  // f64 timestamp, then varint id, u8 fields and the fields, per player
+    MESSAGE_PING,          // f64 client timestamp
+    MESSAGE_PONG,          // f64 client timestamp (from the ping), f64 server timestamp
+};
+enum {                     // Fields present in a move, as deltas of the last one.
+    MOVE_X = 1 << 0,       // u16 x
+    MOVE_Y = 1 << 1,       // u16 y
+    MOVE_HEADING = 1 << 2, // u8 heading
+    MOVE_ALL = MOVE_X | MOVE_Y | MOVE_HEADING,
+};
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+    size_t offset;
+    bool error;            // Set when reading past the end.
+} Reader;
+typedef struct {
+    uint8_t* data;
+    size_t capacity;
+    size_t size;
+    bool error;            // Set when writing past the end.
+} Writer;
+uint8_t read_u8(Reader* reader);
+uint16_t read_u16(Reader* reader);
+uint64_t read_varint(Reader* reader);
+int64_t read_zigzag(Reader* reader);
+double read_f64(Reader* reader);
+void write_u8(Writer* writer, uint8_t value);
+void write_u16(Writer* writer, uint16_t value);
+void write_varint(Writer* writer, uint64_t value);
+void write_zigzag(Writer* writer, int64_t value);
+void write_f64(Writer* writer, double value);
+uint16_t quantize_position(float x, float size);
+float dequantize_position(uint16_t q, float size);
+uint8_t quantize_angle(float angle);
+float dequantize_angle(uint8_t q);
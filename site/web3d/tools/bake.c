@@ -0,0 +1,32 @@
+// Asset compiler. Runs the same GIF decoding and preprocessing as the game does
+// at startup (texel layout, mipmaps, atlas sub-textures, average colors, glyph
+// widths), and writes the result to a blob that the game embeds and uses in
+// place when built with WEB3D_BAKED. Built and run on the host by the makefile.
+#include <stdio.h>
+#include "../src/web3d.h"
+
+int main(int argc, char** argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <output>\n", argv[0]);
+        return 1;
+    }
+
+    // Load and pack the assets.
+    static uint8_t blob[1 << 18];
+    assets_load();
+    const size_t size = assets_pack(blob, sizeof(blob));
+    if (!size) {
+        fprintf(stderr, "%s: assets don't fit in %zu bytes\n", argv[0], sizeof(blob));
+        return 1;
+    }
+
+    // Write the blob out.
+    FILE* file = fopen(argv[1], "wb");
+    if (!file || fwrite(blob, 1, size, file) != size || fclose(file)) {
+        perror(argv[1]);
+        return 1;
+    }
+    printf("%s: %zu bytes\n", argv[1], size);
+    return 0;
+}
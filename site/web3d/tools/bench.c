@@ -0,0 +1,154 @@
+// Microbenchmarks for the renderer, built for the host with `make bench`. The
+// game is compiled straight into this file, so that internal functions can be
+// timed too, and the functions it imports from JavaScript are stubbed out (in
+// tools/host.c). Host builds have neither SIMD nor threads, so this times the
+// scalar fallbacks of the code that the browser runs.
+//
+// Usage: web3d-bench [width height]
+#include <stdio.h>
+#include <stdlib.h>
+#include "../src/main.c"
+#include "host.c"
+
+// Number of timed samples per benchmark. Each sample is a batch of operations,
+// except for frames, which are timed one at a time.
+#define SAMPLES 200
+
+// Images to decode.
+static const uint8_t bench_ghost_gif[] = {
+    #embed "../assets/ghost.gif"
+};
+static const uint8_t bench_font_gif[] = {
+    #embed "../assets/font_big.gif"
+};
+
+// Camera poses for drawing frames: a position relative to a room's corner, and
+// a view angle.
+static const struct {
+    int room;
+    float x, y, angle;
+} bench_poses[] = {
+    { 0, 0.5f, 0.5f, 0.0f },
+    { 3, 0.5f, 0.5f, 2.0f },
+    { 7, 0.5f, 0.5f, 4.0f },
+    { 12, 0.5f, 0.5f, 5.5f },
+};
+#define BENCH_POSES (sizeof(bench_poses) / sizeof(*bench_poses))
+
+// Results are added to this, so that the compiler can't throw the work away.
+static volatile uint32_t bench_sink;
+
+static int compare_doubles(const void* a, const void* b)
+{
+    const double x = *(const double*) a;
+    const double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+// Print the median and percentiles of a set of samples, in nanoseconds per
+// operation. Frames also get the frame rate that the median works out to.
+static void bench_report(const char* name, double* samples, int count, bool frames)
+{
+    qsort(samples, count, sizeof(*samples), compare_doubles);
+    const double p50 = samples[count * 50 / 100];
+    const double p90 = samples[count * 90 / 100];
+    const double p99 = samples[count * 99 / 100];
+    printf("%-24s %12.1f %12.1f %12.1f", name, p50, p90, p99);
+    if (frames)
+        printf(" %10.1f", 1e9 / p50);
+    printf("\n");
+}
+
+// Time `count` calls of a function per sample, and report the time per call.
+static void bench_run(const char* name, void (*function)(int), int count)
+{
+    double samples[SAMPLES];
+    function(0); // Warm up.
+    for (int i = 0; i < SAMPLES; i++) {
+        const double start = get_time();
+        for (int j = 0; j < count; j++)
+            function(j);
+        samples[i] = (get_time() - start) * 1e6 / count;
+    }
+    bench_report(name, samples, SAMPLES, false);
+}
+
+static void bench_raycast(int i)
+{
+    const int room = i % MAP_ROOMS;
+    const float angle = i * 0.37f;
+    bench_sink += raycast(map_room_x(room) + 0.5f, map_room_y(room) + 0.5f, cosf(angle), sinf(angle), 0.0f);
+}
+
+static void bench_map_generate(int i)
+{
+    random_seed(i);
+    map_generate();
+    bench_sink += map_get(i % MAP_W, i / MAP_W % MAP_H);
+}
+
+static void bench_gif_ghost(int i)
+{
+    static uint32_t pixels[259 * 37];
+    bench_sink += gif_get_pixels(bench_ghost_gif, sizeof(bench_ghost_gif), pixels, sizeof(pixels));
+}
+
+static void bench_gif_font(int i)
+{
+    static uint32_t pixels[144 * 84];
+    bench_sink += gif_get_pixels(bench_font_gif, sizeof(bench_font_gif), pixels, sizeof(pixels));
+}
+
+static void bench_apply_fog(int i)
+{
+    bench_sink += apply_fog(i * 0x9e3779b9u, (i & 63) * 0.25f, i & 511, i >> 9 & 511);
+}
+
+// Draw frames from each camera pose, timing every frame.
+static void bench_draw(const char* name, bool interlace)
+{
+    static double samples[BENCH_POSES * SAMPLES];
+    static double timestamp;
+    set_interlaced(interlace);
+    for (size_t pose = 0; pose < BENCH_POSES; pose++) {
+        player_x = player_x_smooth = map_room_x(bench_poses[pose].room) + bench_poses[pose].x;
+        player_y = player_y_smooth = map_room_y(bench_poses[pose].room) + bench_poses[pose].y;
+        player_angle = player_angle_smooth = bench_poses[pose].angle;
+        for (int i = -1; i < SAMPLES; i++) {
+            timestamp += 1000.0 / 60.0;
+            const double start = get_time();
+            const uint32_t* pixels = draw(NULL, timestamp, timestamp, true);
+            bench_sink += pixels[i & 1023];
+            if (i >= 0) // The first frame is a warmup.
+                samples[pose * SAMPLES + i] = (get_time() - start) * 1e6;
+        }
+    }
+    bench_report(name, samples, BENCH_POSES * SAMPLES, true);
+}
+
+int main(int argc, char** argv)
+{
+    const int w = argc > 2 ? atoi(argv[1]) : FRAME_W;
+    const int h = argc > 2 ? atoi(argv[2]) : FRAME_H;
+
+    printf("Scalar build without SIMD or render threads (unlike the wasm build)\n\n");
+    printf("%-24s %12s %12s %12s %10s\n", "benchmark (ns/op)", "p50", "p90", "p99", "frames/s");
+    bench_run("map_generate()", bench_map_generate, 10);
+    bench_run("gif_get_pixels() ghost", bench_gif_ghost, 10);
+    bench_run("gif_get_pixels() font", bench_gif_font, 10);
+    bench_run("apply_fog()", bench_apply_fog, 10000);
+
+    // Start a match, so that the map and the gems are the same on every run.
+    init();
+    set_resolution(w, h);
+    recv_join(1, 0, "self");
+    recv_join(2, 0, "other");
+    recv_begin(1, 2, 1.0, (double) ALL_GEMS);
+    bench_run("raycast()", bench_raycast, 1000);
+
+    char name[64];
+    snprintf(name, sizeof(name), "draw() %dx%d", frame_width(), frame_height());
+    bench_draw(name, false);
+    bench_draw("draw() interlaced", true);
+    return 0;
+}
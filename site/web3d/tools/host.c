@@ -0,0 +1,22 @@
+// Stubs for the functions that the engine imports from JavaScript, for host
+// builds of the tools that include the engine. External references are plain
+// pointers here, and strings are passed as C strings.
+#include <stdio.h>
+#include <time.h>
+
+size_t string_from_extern(__externref_t string, char* buffer, size_t buffer_size)
+{
+    return snprintf(buffer, buffer_size, "%s", string ? (const char*) string : "");
+}
+
+bool send_message(__externref_t socket, const void* data, size_t size)
+{
+    return socket != NULL;
+}
+
+double get_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e3 + now.tv_nsec * 1e-6;
+}
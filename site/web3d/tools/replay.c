@@ -0,0 +1,262 @@
+// Headless replayer for traces recorded in the browser (see trace.ts), built
+// for the host with `make replay`. Every recorded call is made again as fast as
+// possible, timing each frame and hashing its pixels, so that the same session
+// can be used to measure how long frames take and to check that a change to
+// the renderer doesn't change what it draws.
+//
+// Frame budgets aren't replayed, since adaptive resolution depends on how long
+// frames take, which would make the output different on every run. Frames are
+// drawn at the resolution set by `setResolution()` instead.
+//
+// Usage: web3d-replay [-v] trace
+//
+// With -v, the size, time and hash of every frame is printed as well, which
+// can be compared between runs to find the first frame that changed.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/main.c"
+#include "host.c"
+
+#define TRACE_MAGIC 0x54443357 // "W3DT"
+#define TRACE_VERSION 2
+
+// Functions that are recorded (this should match the list in trace.ts).
+enum {
+    TRACE_INIT,
+    TRACE_SET_RESOLUTION,
+    TRACE_SET_FRAME_BUDGET,
+    TRACE_SET_INTERLACED,
+    TRACE_KEYDOWN,
+    TRACE_KEYUP,
+    TRACE_RECV_JOIN,
+    TRACE_RECV_QUIT,
+    TRACE_RECV_BEGIN,
+    TRACE_RECV_COUNT,
+    TRACE_RECV_END,
+    TRACE_RECV_MOVE,
+    TRACE_RECV_COLLECT,
+    TRACE_DRAW,
+    TRACE_MESSAGE,
+    TRACE_RECV_MESSAGES,
+};
+
+// Position in a trace. Reads past the end return zeros and set `error`.
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+    size_t position;
+    bool error;
+} Trace;
+
+static const uint8_t* trace_read(Trace* trace, size_t size)
+{
+    static const uint8_t zeros[256];
+    if (trace->error || size > trace->size - trace->position) {
+        trace->error = true;
+        return zeros;
+    }
+    trace->position += size;
+    return trace->data + trace->position - size;
+}
+
+static uint8_t trace_u8(Trace* trace)
+{
+    return *trace_read(trace, 1);
+}
+
+static uint32_t trace_u32(Trace* trace)
+{
+    const uint8_t* p = trace_read(trace, 4);
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static int32_t trace_i32(Trace* trace)
+{
+    return (int32_t) trace_u32(trace);
+}
+
+static float trace_f32(Trace* trace)
+{
+    const uint32_t bits = trace_u32(trace);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static double trace_f64(Trace* trace)
+{
+    const uint64_t low = trace_u32(trace);
+    const uint64_t bits = low | (uint64_t) trace_u32(trace) << 32;
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static void trace_string(Trace* trace, char buffer[256])
+{
+    const uint8_t length = trace_u8(trace);
+    memcpy(buffer, trace_read(trace, length), length);
+    buffer[length] = '\0';
+}
+
+// Add a message to the engine's message queue, the same way as engine.ts.
+static void queue_message(const uint8_t* data, uint32_t size)
+{
+    const uint32_t padded = MESSAGE_HEADER_SIZE + ((size + 7) & ~7u);
+    if (padded > message_queue.capacity)
+        return;
+    if (message_queue.length + padded > message_queue.capacity)
+        recv_messages();
+    memcpy(&message_queue.data[message_queue.length], &size, sizeof(size));
+    memcpy(&message_queue.data[message_queue.length + MESSAGE_HEADER_SIZE], data, size);
+    message_queue.length += padded;
+}
+
+// FNV-1a hash of a frame.
+static uint64_t hash_frame(const void* pixels, size_t size)
+{
+    const uint8_t* bytes = pixels;
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ bytes[i]) * 0x100000001b3;
+    return hash;
+}
+
+static int compare_doubles(const void* a, const void* b)
+{
+    const double x = *(const double*) a;
+    const double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+static uint8_t* read_file(const char* path, size_t* size)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+    uint8_t* data = NULL;
+    *size = 0;
+    for (size_t capacity = 1 << 16;; capacity *= 2) {
+        data = realloc(data, capacity);
+        *size += fread(data + *size, 1, capacity - *size, file);
+        if (*size < capacity)
+            break;
+    }
+    fclose(file);
+    return data;
+}
+
+int main(int argc, char** argv)
+{
+    const bool verbose = argc > 2 && !strcmp(argv[1], "-v");
+    if (argc != 2 + verbose) {
+        fprintf(stderr, "Usage: %s [-v] trace\n", argv[0]);
+        return 1;
+    }
+    Trace trace = { 0 };
+    uint8_t* data = read_file(argv[1 + verbose], &trace.size);
+    if (!data) {
+        fprintf(stderr, "Can't read %s\n", argv[1 + verbose]);
+        return 1;
+    }
+    trace.data = data;
+    if (trace_u32(&trace) != TRACE_MAGIC || trace_u32(&trace) != TRACE_VERSION) {
+        fprintf(stderr, "%s isn't a version %d trace\n", argv[1 + verbose], TRACE_VERSION);
+        return 1;
+    }
+
+    // Replay calls until the end of the trace, keeping the time of every frame
+    // and a hash of all of them together.
+    double* times = NULL;
+    size_t frames = 0, capacity = 0;
+    uint64_t hash = 0;
+    char name[256];
+    while (trace.position < trace.size && !trace.error) {
+        const uint8_t call = trace_u8(&trace);
+        switch (call) {
+        case TRACE_INIT: init(); break;
+        case TRACE_SET_RESOLUTION: {
+            const int w = trace_i32(&trace);
+            set_resolution(w, trace_i32(&trace));
+        } break;
+        case TRACE_SET_FRAME_BUDGET: trace_f64(&trace); break;
+        case TRACE_SET_INTERLACED: set_interlaced(trace_u8(&trace)); break;
+        case TRACE_KEYDOWN: keydown(trace_u8(&trace)); break;
+        case TRACE_KEYUP: keyup(trace_u8(&trace)); break;
+        case TRACE_RECV_JOIN: {
+            const uint32_t id = trace_u32(&trace);
+            const int score = trace_i32(&trace);
+            trace_string(&trace, name);
+            recv_join(id, score, name);
+        } break;
+        case TRACE_RECV_QUIT: recv_quit(trace_u32(&trace)); break;
+        case TRACE_RECV_BEGIN: {
+            const uint32_t self = trace_u32(&trace);
+            const uint32_t ghost = trace_u32(&trace);
+            const double timestamp = trace_f64(&trace);
+            recv_begin(self, ghost, timestamp, trace_f64(&trace));
+        } break;
+        case TRACE_RECV_COUNT: recv_count(trace_f64(&trace)); break;
+        case TRACE_RECV_END: recv_end(); break;
+        case TRACE_RECV_MOVE: {
+            const uint32_t id = trace_u32(&trace);
+            const float x = trace_f32(&trace);
+            const float y = trace_f32(&trace);
+            const float dx = trace_f32(&trace);
+            recv_move(id, x, y, dx, trace_f32(&trace));
+        } break;
+        case TRACE_RECV_COLLECT: {
+            const uint32_t id = trace_u32(&trace);
+            const int gem_index = trace_i32(&trace);
+            recv_collect(id, gem_index, trace_i32(&trace));
+        } break;
+        case TRACE_DRAW: {
+            const double timestamp = trace_f64(&trace);
+            const double date_now = trace_f64(&trace);
+            const bool logged_in = trace_u8(&trace);
+            if (trace.error)
+                break;
+            const double start = get_time();
+            const void* pixels = draw(NULL, timestamp, date_now, logged_in);
+            const double time = get_time() - start;
+            const uint64_t frame_hash = hash_frame(pixels, frame_w * frame_h * sizeof(*frame));
+            hash = hash * 31 + frame_hash;
+            if (frames == capacity) {
+                capacity = capacity ? capacity * 2 : 1024;
+                times = realloc(times, capacity * sizeof(*times));
+            }
+            times[frames++] = time;
+            if (verbose)
+                printf("frame %zu %dx%d %.3f ms %016llx\n", frames - 1, frame_w, frame_h, time, (unsigned long long) frame_hash);
+        } break;
+        case TRACE_MESSAGE: {
+            const uint32_t size = trace_u32(&trace);
+            const uint8_t* data = trace_read(&trace, size);
+            if (!trace.error)
+                queue_message(data, size);
+        } break;
+        case TRACE_RECV_MESSAGES: recv_messages(); break;
+        default:
+            fprintf(stderr, "Unknown call %d at offset %zu\n", call, trace.position - 1);
+            return 1;
+        }
+    }
+    if (trace.error)
+        fprintf(stderr, "Trace ends in the middle of a call\n");
+
+    // Report the distribution of frame times, and the hash of all frames.
+    double total = 0.0;
+    for (size_t i = 0; i < frames; i++)
+        total += times[i];
+    printf("%zu frames in %.1f ms (%.1f frames/s)\n", frames, total, frames ? frames * 1e3 / total : 0.0);
+    if (frames) {
+        qsort(times, frames, sizeof(*times), compare_doubles);
+        printf("frame time (ms): p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+               times[frames * 50 / 100], times[frames * 90 / 100], times[frames * 99 / 100], times[frames - 1]);
+    }
+    printf("hash %016llx\n", (unsigned long long) hash);
+    free(times);
+    free(data);
+    return trace.error;
+}
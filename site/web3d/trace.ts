@@ -0,0 +1,127 @@
+// Recording of calls into the engine, for replaying them later with
+// tools/replay.c. A frame only depends on the arguments of these calls, so a
+// trace reproduces a session exactly. The trace starts with the four bytes
+// "W3DT" and a 32-bit version, followed by one record per call: a byte for the
+// function, then its arguments, little-endian. Strings are a length byte
+// followed by UTF-8 bytes, and byte arrays a 32-bit length followed by the bytes.
+// Messages from the server that are added to the engine's message queue are
+// recorded as well.
+const TRACE_MAGIC = 0x54443357; // "W3DT"
+const TRACE_VERSION = 2;
+
+// Functions that are recorded (this should match the list in tools/replay.c).
+enum TraceCall {
+    Init = 0,
+    SetResolution,  // i32 w, i32 h
+    SetFrameBudget, // f64 milliseconds
+    SetInterlaced,  // u8 enabled
+    Keydown,        // u8 keycode
+    Keyup,          // u8 keycode
+    RecvJoin,       // u32 id, i32 score, string name
+    RecvQuit,       // u32 id
+    RecvBegin,      // u32 self, u32 ghost, f64 timestamp, f64 gems
+    RecvCount,      // f64 timestamp
+    RecvEnd,
+    RecvMove,       // u32 id, f32 x, f32 y, f32 dx, f32 dy
+    RecvCollect,    // u32 id, i32 gem_index, i32 updated_score
+    Draw,           // f64 timestamp, f64 date_now, u8 logged_in
+    Message,        // bytes message
+    RecvMessages,
+}
+
+// Types of arguments, in the order they're written. Sockets aren't part of the
+// trace, and take up no space.
+type Arg = "u8" | "i32" | "u32" | "f32" | "f64" | "string" | "bytes" | "socket";
+
+const TRACE_EXPORTS: Record<string, [TraceCall, Arg[]]> = {
+    init: [TraceCall.Init, []],
+    setResolution: [TraceCall.SetResolution, ["i32", "i32"]],
+    setFrameBudget: [TraceCall.SetFrameBudget, ["f64"]],
+    setInterlaced: [TraceCall.SetInterlaced, ["u8"]],
+    keydown: [TraceCall.Keydown, ["u8"]],
+    keyup: [TraceCall.Keyup, ["u8"]],
+    recvJoin: [TraceCall.RecvJoin, ["u32", "i32", "string"]],
+    recvQuit: [TraceCall.RecvQuit, ["u32"]],
+    recvBegin: [TraceCall.RecvBegin, ["u32", "u32", "f64", "f64"]],
+    recvCount: [TraceCall.RecvCount, ["f64"]],
+    recvEnd: [TraceCall.RecvEnd, []],
+    recvMove: [TraceCall.RecvMove, ["u32", "f32", "f32", "f32", "f32"]],
+    recvCollect: [TraceCall.RecvCollect, ["u32", "i32", "i32"]],
+    draw: [TraceCall.Draw, ["socket", "f64", "f64", "u8"]],
+    recvMessages: [TraceCall.RecvMessages, []],
+};
+
+// Growable byte buffer that records are written to.
+class TraceWriter {
+    bytes = new Uint8Array(1 << 16);
+    view = new DataView(this.bytes.buffer);
+    length = 0;
+
+    reserve(size: number) {
+        if (this.length + size <= this.bytes.length)
+            return;
+        const bytes = new Uint8Array(Math.max(this.bytes.length * 2, this.length + size));
+        bytes.set(this.bytes.subarray(0, this.length));
+        this.bytes = bytes;
+        this.view = new DataView(bytes.buffer);
+    }
+
+    write(type: Arg, value: any) {
+        switch (type) {
+            case "u8": this.reserve(1); this.view.setUint8(this.length, Number(value)); this.length += 1; break;
+            case "i32": this.reserve(4); this.view.setInt32(this.length, value, true); this.length += 4; break;
+            case "u32": this.reserve(4); this.view.setUint32(this.length, value, true); this.length += 4; break;
+            case "f32": this.reserve(4); this.view.setFloat32(this.length, value, true); this.length += 4; break;
+            case "f64": this.reserve(8); this.view.setFloat64(this.length, value, true); this.length += 8; break;
+            case "string": {
+                const string = new TextEncoder().encode(String(value)).subarray(0, 255);
+                this.write("u8", string.length);
+                this.reserve(string.length);
+                this.bytes.set(string, this.length);
+                this.length += string.length;
+            } break;
+            case "bytes": {
+                this.write("u32", value.length);
+                this.reserve(value.length);
+                this.bytes.set(value, this.length);
+                this.length += value.length;
+            } break;
+            case "socket": break;
+        }
+    }
+}
+
+// Wrap the exports of an engine instance so that every recorded call is
+// written to a trace before it's passed on. Returns the wrapped exports, a
+// function for recording a message added to the message queue, and a function
+// that returns the trace so far.
+export function recordTrace(exports: any) {
+    const writer = new TraceWriter();
+    writer.write("u32", TRACE_MAGIC);
+    writer.write("u32", TRACE_VERSION);
+    const wrapped = { ...exports };
+    for (const [name, [call, args]] of Object.entries(TRACE_EXPORTS)) {
+        wrapped[name] = (...values: any[]) => {
+            writer.write("u8", call);
+            args.forEach((type, i) => writer.write(type, values[i]));
+            return exports[name](...values);
+        };
+    }
+    return {
+        exports: wrapped,
+        message: (data: Uint8Array) => {
+            writer.write("u8", TraceCall.Message);
+            writer.write("bytes", data);
+        },
+        trace: () => writer.bytes.slice(0, writer.length),
+    };
+}
+
+// Save a trace as a file.
+export function downloadTrace(trace: Uint8Array, name = "web3d.trace") {
+    const link = document.createElement("a");
+    link.href = URL.createObjectURL(new Blob([trace], { type: "application/octet-stream" }));
+    link.download = name;
+    link.click();
+    URL.revokeObjectURL(link.href);
+}
@@ -0,0 +1,17 @@
+// Render worker for the threaded build of the engine. Each worker instantiates
+// the module on top of the shared memory, switches to its own stack and then
+// stays inside `threadMain()`, drawing columns whenever a new frame starts.
+onmessage = async (event: MessageEvent) => {
+    const { module, memory, index } = event.data;
+    const instance = await WebAssembly.instantiate(module, {
+        env: { memory },
+        "islands/Web3D": {
+            getString: () => 0,
+            sendMessage: () => {},
+            getTime: () => performance.now(),
+        },
+    });
+    const exports = instance.exports as any;
+    exports.__stack_pointer.value = exports.threadStack(index);
+    exports.threadMain();
+};